@@ -0,0 +1,172 @@
+#pragma GCC optimize ("O3")
+
+#include <string.h>
+#include <math.h>
+
+#include "blip.h"
+
+#include <esp_attr.h>
+
+#define TIME_BITS 21 /* span times are in 2MHz units, 1<<21 per second */
+#define PHASES (1<<BLIP_PHASE_BITS)
+#define BASS_SHIFT 9 /* dc blocker, about 10Hz at 32kHz */
+
+static short kernel[PHASES][BLIP_TAPS];
+
+static struct
+{
+	unsigned hz;
+	unsigned frac;
+	int avail;
+	int used; /* samples from the start of buf that deltas reach */
+	int suml, sumr;
+	int buf[2 * (BLIP_SIZE + BLIP_TAPS + 1)];
+} blip;
+
+
+/* Windowed sinc impulses, one row per sub-sample phase, each summing
+   to exactly 1<<BLIP_KERNEL_BITS so that steps settle without drift */
+static void makekernel()
+{
+	int p, k, sum;
+	double x, h, w, row[BLIP_TAPS], total;
+	const double fc = 0.45, pi = 3.14159265358979;
+
+	for (p = 0; p < PHASES; p++)
+	{
+		total = 0;
+		for (k = 0; k < BLIP_TAPS; k++)
+		{
+			x = k - BLIP_TAPS/2 + 1 - (double)p / PHASES;
+			h = x ? sin(2*pi*fc*x) / (pi*x) : 2*fc;
+			w = 0.42 + 0.5*cos(pi*x / (BLIP_TAPS/2))
+				+ 0.08*cos(2*pi*x / (BLIP_TAPS/2));
+			row[k] = h * w;
+			total += row[k];
+		}
+		sum = 0;
+		for (k = 0; k < BLIP_TAPS; k++)
+		{
+			kernel[p][k] = (short)floor(row[k] / total * (1<<BLIP_KERNEL_BITS) + 0.5);
+			sum += kernel[p][k];
+		}
+		kernel[p][BLIP_TAPS/2 - 1] += (1<<BLIP_KERNEL_BITS) - sum;
+	}
+}
+
+void blip_init(int hz)
+{
+	static int made;
+	if (!made) makekernel();
+	made = 1;
+	blip.hz = hz;
+	blip_clear();
+}
+
+void blip_clear()
+{
+	blip.frac = 0;
+	blip.avail = 0;
+	blip.used = 0;
+	blip.suml = blip.sumr = 0;
+	memset(blip.buf, 0, sizeof blip.buf);
+}
+
+/* Longest span, in 2MHz units, whose samples still fit the buffer */
+int blip_span()
+{
+	if (!blip.hz) return 0;
+	return ((unsigned)(BLIP_SIZE - 1) << TIME_BITS) / blip.hz;
+}
+
+void IRAM_ATTR blip_add(unsigned t, int l, int r)
+{
+	unsigned p = blip.frac + t * blip.hz;
+	const short *k = kernel[(p >> (TIME_BITS - BLIP_PHASE_BITS)) & (PHASES-1)];
+	int *out = blip.buf + 2 * (blip.avail + (p >> TIME_BITS));
+	int i;
+
+	if (blip.used < blip.avail + (int)(p >> TIME_BITS) + BLIP_TAPS)
+		blip.used = blip.avail + (p >> TIME_BITS) + BLIP_TAPS;
+
+	if (l && r)
+	{
+		for (i = 0; i < BLIP_TAPS; i++)
+		{
+			out[2*i] += l * k[i];
+			out[2*i+1] += r * k[i];
+		}
+	}
+	else if (l)
+	{
+		for (i = 0; i < BLIP_TAPS; i++)
+			out[2*i] += l * k[i];
+	}
+	else if (r)
+	{
+		for (i = 0; i < BLIP_TAPS; i++)
+			out[2*i+1] += r * k[i];
+	}
+}
+
+int blip_end(unsigned t)
+{
+	blip.frac += t * blip.hz;
+	blip.avail += blip.frac >> TIME_BITS;
+	blip.frac &= (1 << TIME_BITS) - 1;
+	return blip.avail;
+}
+
+/* True while the output has settled on silence: no deltas are waiting
+   and the integrators have decayed to where they read back as zero */
+int blip_quiet()
+{
+	return blip.used <= 0
+		&& (unsigned)blip.suml < (1<<BLIP_KERNEL_BITS)
+		&& (unsigned)blip.sumr < (1<<BLIP_KERNEL_BITS);
+}
+
+/* Integrates and consumes the first count available samples, scaled by
+   volume (256 is unity); out may be NULL to drop them */
+void IRAM_ATTR blip_read(int16_t *out, int count, int stereo, int volume)
+{
+	int i, l, r;
+	int suml = blip.suml, sumr = blip.sumr;
+	int *in = blip.buf;
+
+	if (count > blip.avail) count = blip.avail;
+	if (blip_quiet())
+	{
+		/* the buffer is all zeros, there is nothing to integrate or move */
+		if (out) memset(out, 0, count * (stereo ? 2 : 1) * sizeof *out);
+		blip.avail -= count;
+		return;
+	}
+	for (i = 0; i < count; i++)
+	{
+		l = suml >> BLIP_KERNEL_BITS;
+		r = sumr >> BLIP_KERNEL_BITS;
+		suml += in[2*i] - (l << (BLIP_KERNEL_BITS - BASS_SHIFT));
+		sumr += in[2*i+1] - (r << (BLIP_KERNEL_BITS - BASS_SHIFT));
+		l = (l * volume) >> 8;
+		r = (r * volume) >> 8;
+		if (l > 32767) l = 32767;
+		else if (l < -32768) l = -32768;
+		if (r > 32767) r = 32767;
+		else if (r < -32768) r = -32768;
+		if (!out) continue;
+		if (stereo)
+		{
+			*out++ = l;
+			*out++ = r;
+		}
+		else *out++ = (l + r) >> 1;
+	}
+	blip.suml = suml;
+	blip.sumr = sumr;
+
+	blip.avail -= count;
+	blip.used -= count;
+	memmove(blip.buf, blip.buf + 2*count, 2 * (blip.avail + BLIP_TAPS) * sizeof *in);
+	memset(blip.buf + 2 * (blip.avail + BLIP_TAPS), 0, 2 * count * sizeof *in);
+}
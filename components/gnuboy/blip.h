@@ -0,0 +1,27 @@
+#ifndef __BLIP_H__
+#define __BLIP_H__
+
+#include "defs.h"
+#include <stdint.h>
+
+/*
+ * Band-limited step synthesis. Channels report amplitude changes as
+ * stereo deltas stamped in 2MHz units from the start of the current
+ * span; blip_end() closes the span and blip_read() integrates the
+ * completed output samples in one pass.
+ */
+
+#define BLIP_SIZE 1024 /* output samples in one span, at most */
+#define BLIP_TAPS 16
+#define BLIP_PHASE_BITS 5
+#define BLIP_KERNEL_BITS 12
+
+void blip_init(int hz);
+void blip_clear();
+int blip_span();
+void blip_add(unsigned t, int l, int r);
+int blip_end(unsigned t);
+int blip_quiet();
+void blip_read(int16_t *out, int count, int stereo, int volume);
+
+#endif
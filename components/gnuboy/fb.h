@@ -6,6 +6,27 @@
 
 #include "defs.h"
 
+/*
+ * With an indexed framebuffer (pelsize 1) the LCD writes the raw
+ * 6-bit colour indices and the palettes they refer to trail the
+ * pixels: a frame keeps up to FB_PAL_SNAPSHOTS copies of the 64-entry
+ * RGB565 palette, and line[] selects the one in effect for each line.
+ */
+#define FB_PAL_SNAPSHOTS 16
+
+/* framebuffers the display side cycles through */
+#define FB_COUNT 3
+
+struct fbpal
+{
+	un16 pal[FB_PAL_SNAPSHOTS][64];
+	byte line[144];
+	int count;
+};
+
+#define FB_PAL(p) ((struct fbpal *)((byte *)(p) + fb.h * fb.pitch))
+#define FB_SIZE() (fb.h * fb.pitch + (fb.indexed ? sizeof(struct fbpal) : 0))
+
 struct fb
 {
 	byte *ptr;
@@ -20,6 +41,16 @@ struct fb
 	int yuv;
 	int enabled;
 	int dirty;
+	/* Racing-the-beam output: when band is set, lines are drawn into a
+	 * band of bandlines lines at ptr and handed on through band() as
+	 * soon as the band is complete; it returns where to draw the next
+	 * band. There is no framebuffer to keep, so pelsize must be 2. */
+	int bandlines;
+	byte *(*band)(byte *ptr, int y, int n);
+	/* Frame blending: frames the display skips are drawn as well, into
+	 * a second frame of FB_SIZE() bytes right after ptr, so the display
+	 * can average each presented frame with the one before it. */
+	int blend;
 };
 
 
@@ -26,6 +26,7 @@ struct hw
 	byte pad;
 	int cgb, gba;
 	int hdma;
+	int padreads; /* P1 reads since the last vblank */
 };
 
 
@@ -15,7 +15,9 @@
 #endif
 
 #include <stdlib.h>
+#include <math.h>
 #include <esp_attr.h>
+#include <esp_timer.h>
 #include <stdint.h>
 
 struct lcd lcd;
@@ -49,22 +51,35 @@ struct scan scan;
 static int sprsort = 1;
 static int sprdebug = 0;
 
-// BGR
-#if 0
-// Testing/Debug palette
-static int dmg_pal[4][4] = {{0xffffff, 0x808080, 0x404040, 0x000000},
-							{0xff0000, 0x800000, 0x400000, 0x000000},
-							{0x00ff00, 0x008000, 0x004000, 0x000000},
-							{0x0000ff, 0x000080, 0x000040, 0x000000} };
-#else
+/*
+ * DMG palettes. Each palette map (BG, window, OBP0, OBP1) keeps its
+ * four shades precomputed as RGB565, so a BGP/OBP write only picks
+ * four of them into PAL2. Colours are 0xBBGGRR.
+ */
 #define GB_DEFAULT_PALETTE { 0xd5f3ef, 0x7ab6a3, 0x3b6137, 0x161c04 }
-static int dmg_pal[4][4] = {GB_DEFAULT_PALETTE,
-	 						GB_DEFAULT_PALETTE,
-							GB_DEFAULT_PALETTE,
-							GB_DEFAULT_PALETTE };
-#endif
+#define GB_GREY_PALETTE { 0xffffff, 0xaaaaaa, 0x555555, 0x000000 }
+#define GB_POCKET_PALETTE { 0xa1cfc4, 0x6d958b, 0x3c534d, 0x1f1f1f }
+#define GB_LIGHT_PALETTE { 0x81b500, 0x719a00, 0x4a6900, 0x3b4f00 }
+#define GBC_BG_PALETTE { 0xffffff, 0x31ff7b, 0xc56300, 0x000000 }
+#define GBC_OBJ_PALETTE { 0xffffff, 0x8484ff, 0x3a3a94, 0x000000 }
+
+static const struct
+{
+	const char *name;
+	int pal[4][4];
+} dmg_presets[LCD_DMG_PRESETS] =
+{
+	{ "Green", { GB_DEFAULT_PALETTE, GB_DEFAULT_PALETTE, GB_DEFAULT_PALETTE, GB_DEFAULT_PALETTE } },
+	{ "Grey", { GB_GREY_PALETTE, GB_GREY_PALETTE, GB_GREY_PALETTE, GB_GREY_PALETTE } },
+	{ "Pocket", { GB_POCKET_PALETTE, GB_POCKET_PALETTE, GB_POCKET_PALETTE, GB_POCKET_PALETTE } },
+	{ "Light", { GB_LIGHT_PALETTE, GB_LIGHT_PALETTE, GB_LIGHT_PALETTE, GB_LIGHT_PALETTE } },
+	{ "Colour", { GBC_BG_PALETTE, GBC_BG_PALETTE, GBC_OBJ_PALETTE, GBC_OBJ_PALETTE } },
+};
+
+static un16 dmg_shade[4][4];
+static int dmg_shade_set;
 
-static byte *vdest;
+static byte *vdest, *vframe;
 
 //#ifdef ALLOW_UNALIGNED_IO /* long long is ok since this is i386-only anyway? */
 #define MEMCPY8(d, s) ((*(long long *)(d)) = (*(long long *)(s)))
@@ -150,9 +165,9 @@ static const short DRAM_ATTR wraptable[64] =
 	0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,-32
 };
 
-static void IRAM_ATTR tilebuf()
+static void IRAM_ATTR bg_tilebuf(int cnt)
 {
-	int i, cnt;
+	int i;
 	int base;
 	byte *tilemap, *attrmap;
 	int *tilebuf;
@@ -164,7 +179,6 @@ static void IRAM_ATTR tilebuf()
 	attrmap = lcd.vbank[1] + base;
 	tilebuf = BG;
 	wrap = wraptable + S;
-	cnt = ((WX + 7) >> 3) + 1;
 
 	if (hw.cgb)
 	{
@@ -174,7 +188,8 @@ static void IRAM_ATTR tilebuf()
 				*(tilebuf++) = *tilemap
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*attrmap & 0x07) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
 				attrmap += *wrap + 1;
 				tilemap += *(wrap++) + 1;
 			}
@@ -184,7 +199,8 @@ static void IRAM_ATTR tilebuf()
 				*(tilebuf++) = (256 + ((n8)*tilemap))
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*attrmap & 0x07) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
 				attrmap += *wrap + 1;
 				tilemap += *(wrap++) + 1;
 			}
@@ -204,8 +220,14 @@ static void IRAM_ATTR tilebuf()
 				tilemap += *(wrap++);
 			}
 	}
+}
 
-	if (WX >= 160) return;
+static void IRAM_ATTR wnd_tilebuf()
+{
+	int i, cnt;
+	int base;
+	byte *tilemap, *attrmap;
+	int *tilebuf;
 
 	base = ((R_LCDC&0x40)?0x1C00:0x1800) + (WT<<5);
 	tilemap = lcd.vbank[0] + base;
@@ -221,7 +243,9 @@ static void IRAM_ATTR tilebuf()
 				*(tilebuf++) = *(tilemap++)
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*(attrmap++)&7) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
+				attrmap++;
 			}
 		else
 			for (i = cnt; i > 0; i--)
@@ -229,7 +253,9 @@ static void IRAM_ATTR tilebuf()
 				*(tilebuf++) = (256 + ((n8)*(tilemap++)))
 					| (((int)*attrmap & 0x08) << 6)
 					| (((int)*attrmap & 0x60) << 5);
-				*(tilebuf++) = (((int)*(attrmap++)&7) << 2);
+				*(tilebuf++) = (((int)*attrmap & 0x07) << 2)
+					| (((int)*attrmap & 0x80) << 1);
+				attrmap++;
 			}
 	}
 	else
@@ -243,6 +269,15 @@ static void IRAM_ATTR tilebuf()
 	}
 }
 
+static void IRAM_ATTR tilebuf()
+{
+	bg_tilebuf(((WX + 7) >> 3) + 1);
+
+	if (WX >= 160) return;
+
+	wnd_tilebuf();
+}
+
 
 static void IRAM_ATTR bg_scan()
 {
@@ -272,7 +307,7 @@ static void IRAM_ATTR bg_scan()
 		case 5:
 			dest[4] = src[4];
 		case 4:
-			dest[3] = src[2];
+			dest[3] = src[3];
 		case 3:
 			dest[2] = src[2];
 		case 2:
@@ -340,122 +375,55 @@ static void IRAM_ATTR wnd_scan()
 		*(dest++) = *(src++);
 }
 
-inline static void blendcpy(byte *dest, byte *src, byte b, int cnt)
-{
-	while (cnt--) *(dest++) = *(src++) | b;
-}
-
-inline static int priused(void *attr)
-{
-	un32 *a = attr;
-	return (int)((a[0]|a[1]|a[2]|a[3]|a[4]|a[5]|a[6]|a[7])&0x80808080);
-}
-
-static void IRAM_ATTR bg_scan_pri()
+/*
+ * CGB background and window in one sweep over the tile attributes.
+ * Besides the colour indices in BUF this fills PRI (when there are
+ * sprites on the line) with 1 for opaque background pixels, or 3 if
+ * the tile's attributes also claim priority over sprites, which is
+ * all spr_scan() needs to resolve sprites against the background.
+ */
+static void IRAM_ATTR cgb_run(byte *dest, byte *pri, int *tile, int v, int u, int cnt, int dopri)
 {
-	int cnt, i;
-	byte *src, *dest;
-
-	if (WX <= 0) return;
-	i = S;
-	cnt = WX;
-	dest = PRI;
-	src = lcd.vbank[1] + ((R_LCDC&0x08)?0x1C00:0x1800) + (T<<5);
+	const byte *src;
+	byte b, pal, p;
+	int i, n;
 
-	if (!priused(src))
+	while (cnt > 0)
 	{
-		memset(dest, 0, cnt);
-		return;
-	}
+		src = get_patpix(tile[0], v) + u;
+		pal = tile[1];
+		p = 1 | ((tile[1] >> 7) & 2);
+		tile += 2;
 
-	memset(dest, src[i++&31]&128, 8-U);
-	dest += 8-U;
-	cnt -= 8-U;
-	if (cnt <= 0) return;
-	while (cnt >= 8)
-	{
-		memset(dest, src[i++&31]&128, 8);
-		dest += 8;
-		cnt -= 8;
-	}
-	memset(dest, src[i&31]&128, cnt);
-}
+		n = 8 - u;
+		if (n > cnt) n = cnt;
+		u = 0;
 
-static void IRAM_ATTR wnd_scan_pri()
-{
-	int cnt, i;
-	byte *src, *dest;
-
-	if (WX >= 160) return;
-	i = 0;
-	cnt = 160 - WX;
-	dest = PRI + WX;
-	src = lcd.vbank[1] + ((R_LCDC&0x40)?0x1C00:0x1800) + (WT<<5);
-
-	if (!priused(src))
-	{
-		memset(dest, 0, cnt);
-		return;
-	}
-
-	while (cnt >= 8)
-	{
-		memset(dest, src[i++]&128, 8);
-		dest += 8;
-		cnt -= 8;
-	}
-	memset(dest, src[i]&128, cnt);
-}
-
-#ifndef ASM_BG_SCAN_COLOR
-static void IRAM_ATTR bg_scan_color()
-{
-	int cnt;
-	byte *src, *dest;
-	int *tile;
-
-	if (WX <= 0) return;
-	cnt = WX;
-	tile = BG;
-	dest = BUF;
+		if (dopri)
+			for (i = 0; i < n; i++)
+			{
+				b = src[i];
+				dest[i] = pal | b;
+				pri[i] = b ? p : 0;
+			}
+		else
+			for (i = 0; i < n; i++)
+				dest[i] = pal | src[i];
 
-	src = get_patpix(*(tile++),V) + U;
-	blendcpy(dest, src, *(tile++), 8-U);
-	dest += 8-U;
-	cnt -= 8-U;
-	if (cnt <= 0) return;
-	while (cnt >= 8)
-	{
-		src = get_patpix(*(tile++), V);
-		blendcpy(dest, src, *(tile++), 8);
-		dest += 8;
-		cnt -= 8;
+		dest += n;
+		pri += n;
+		cnt -= n;
 	}
-	src = get_patpix(*(tile++), V);
-	blendcpy(dest, src, *(tile++), cnt);
 }
-#endif
 
-static void IRAM_ATTR wnd_scan_color()
+static void IRAM_ATTR cgb_scan(int bg)
 {
-	int cnt;
-	byte *src, *dest;
-	int *tile;
+	if (bg && WX > 0) cgb_run(BUF, PRI, BG, V, U, WX, NS);
 
 	if (WX >= 160) return;
-	cnt = 160 - WX;
-	tile = WND;
-	dest = BUF + WX;
 
-	while (cnt >= 8)
-	{
-		src = get_patpix(*(tile++), WV);
-		blendcpy(dest, src, *(tile++), 8);
-		dest += 8;
-		cnt -= 8;
-	}
-	src = get_patpix(*(tile++), WV);
-	blendcpy(dest, src, *(tile++), cnt);
+	if (WX < 0) cgb_run(BUF, PRI, WND, WV, -WX, 160, NS);
+	else cgb_run(BUF + WX, PRI + WX, WND, WV, 0, 160 - WX, NS);
 }
 
 inline static void recolor(byte *buf, byte fill, int cnt)
@@ -571,20 +539,14 @@ static byte bgdup[256];
 static void IRAM_ATTR spr_scan()
 {
 	int i, x;
-	byte pal, b, ns = NS;
+	byte pal, b, mask, ns = NS;
 	byte *src, *dest, *bg, *pri;
 	struct vissprite *vs;
 
 	if (!ns) return;
 
-#if 1
-	memcpy(bgdup, BUF, 256);
-#else
-	for (i = 0; i < 64; ++i)
-	{
-		((int*)bgdup)[i] = ((int*)BUF)[i];
-	}
-#endif
+	if (!hw.cgb)
+		memcpy(bgdup, BUF, 256);
 
 	vs = &VS[ns-1];
 
@@ -609,24 +571,24 @@ static void IRAM_ATTR spr_scan()
 			else i = 8;
 		}
 		pal = vs->pal;
-		if (vs->pri)
+		if (hw.cgb)
 		{
-			bg = bgdup + (dest - BUF);
+			pri = PRI + (dest - BUF);
+			mask = vs->pri ? 1 : 2;
 			while (i--)
 			{
 				b = src[i];
-				if (b && !(bg[i]&3)) dest[i] = pal|b;
+				if (b && !(pri[i] & mask))
+					dest[i] = pal|b;
 			}
 		}
-		else if (hw.cgb)
+		else if (vs->pri)
 		{
 			bg = bgdup + (dest - BUF);
-			pri = PRI + (dest - BUF);
 			while (i--)
 			{
 				b = src[i];
-				if (b && (!pri[i] || !(bg[i]&3)))
-					dest[i] = pal|b;
+				if (b && !(bg[i]&3)) dest[i] = pal|b;
 			}
 		}
 		else while (i--) if (src[i]) dest[i] = pal|src[i];
@@ -637,23 +599,42 @@ static void IRAM_ATTR spr_scan()
 
 inline void lcd_begin()
 {
-	vdest = fb.ptr;
+	vdest = vframe = fb.ptr;
 	WY = R_WY;
 }
 
 
 extern int frame;
-extern uint16_t* displayBuffer[2];
 int lastLcdDisabled = 0;
 
-void IRAM_ATTR lcd_refreshline()
+/* Framebuffers blanked since the LCD was switched off. The display side
+ * may be reading any of the others, so each one is only cleared once
+ * it comes back to the LCD to be drawn into. */
+static byte *blanked[FB_COUNT];
+
+/*
+ * Most frames never touch the scroll registers, LCDC, palettes, VRAM
+ * or OAM while lines are being drawn. For those the visible lines are
+ * only counted here and the whole frame is rendered at vblank by
+ * lcd_render_deferred(), which fetches each row of the tilemap once
+ * and decodes the pattern rows of each tile back to back instead of
+ * re-running tilebuf() for every line. The first raster-affecting
+ * write during a deferred frame (see LCD_RASTER_CHANGE in lcd.h)
+ * renders the pending lines with the old state and switches the rest
+ * of the frame back to the scanline path.
+ */
+
+static int defer = 1;
+int lcd_deferred = 0;
+static int deferred_lines;
+static int bandstart;
+struct lcd_stats lcd_stats;
+
+static byte band[8][168] __attribute__((aligned(4)));
+static byte bandpri[8][168];
+
+static void IRAM_ATTR scan_setup()
 {
-	byte *dest;
-
-	if ((frame % 7) == 0) ++frame;
-
-
-	L = R_LY;
 	X = R_SCX;
 	Y = (R_SCY + L) & 0xff;
 	S = X >> 3;
@@ -666,17 +647,424 @@ void IRAM_ATTR lcd_refreshline()
 		WX = 160;
 	WT = (L - WY) >> 3;
 	WV = (L - WY) & 7;
+}
+
+static void IRAM_ATTR line_out(byte *dest)
+{
+	int cnt = 160;
+	un16* dst = (un16*)dest;
+	byte* src = BUF;
+
+	lcd_stats.lines++;
+
+	if (fb.indexed)
+	{
+		memcpy(dest, BUF, 160);
+		return;
+	}
+
+	while (cnt--) *(dst++) = PAL2[*(src++)];
+}
+
+/*
+ * Lines whose inputs did not change since they were last drawn into
+ * the current framebuffer are not drawn again. A line's signature
+ * hashes the registers it depends on together with generation
+ * counters of the tilemap rows and tiles it fetches, the sprites
+ * spr_enum() picked from OAM and the palette. Signatures are kept per
+ * framebuffer (the display side cycles through several of them) and
+ * for the previously rendered frame, which yields lcd_dirty[].
+ */
+
+/* a frame and its blend frame per framebuffer */
+#define SIG_SLOTS (2 * FB_COUNT)
+
+static un16 tilegen[2][384];
+static un16 mapgen[2][64];
+static un32 palgen;
+
+static struct
+{
+	byte *ptr;
+	un32 sig[144];
+} sigs[SIG_SLOTS];
+static int sigslot;
+static un32 *cursig;
+static un32 lastsig[144];
+static un32 dirty[LCD_DIRTY_WORDS];
+static int rendering;
+
+un32 lcd_dirty[LCD_DIRTY_WORDS];
+
+#define MIX(h, v) ((h) = ((h) ^ (un32)(v)) * 16777619u)
+
+static void sig_select()
+{
+	int i;
+
+	for (i = 0; i < SIG_SLOTS; i++)
+		if (sigs[i].ptr == vframe) break;
+	if (i == SIG_SLOTS)
+	{
+		i = sigslot;
+		sigslot = (sigslot + 1) % SIG_SLOTS;
+		sigs[i].ptr = vframe;
+		memset(sigs[i].sig, 0, sizeof sigs[i].sig);
+	}
+	cursig = sigs[i].sig;
+}
+
+static void sig_invalidate()
+{
+	int i;
+
+	for (i = 0; i < SIG_SLOTS; i++)
+		memset(sigs[i].sig, 0, sizeof sigs[i].sig);
+	memset(lastsig, 0, sizeof lastsig);
+}
+
+static inline un32 tile_sig(un32 h, int *tile, int cnt)
+{
+	int t;
+
+	if (hw.cgb)
+		for (; cnt > 0; cnt--, tile += 2)
+		{
+			t = tile[0];
+			MIX(h, t | (tile[1] << 16));
+			MIX(h, tilegen[(t >> 9) & 1][t & 0x1ff]);
+		}
+	else
+		for (; cnt > 0; cnt--, tile++)
+		{
+			MIX(h, *tile);
+			MIX(h, tilegen[0][*tile]);
+		}
+	return h;
+}
+
+/* Needs scan_setup(), spr_enum() and the tile fetches done for L;
+ * returns non-zero if the line has to be drawn. */
+static int IRAM_ATTR line_changed()
+{
+	un32 h = 2166136261u;
+	int i, row;
+
+	MIX(h, R_LCDC | (X << 8) | (Y << 16));
+	MIX(h, palgen);
+
+	row = (((R_LCDC&0x08) ? 0x400 : 0) + (T << 5)) >> 5;
+	MIX(h, mapgen[0][row] | (mapgen[1][row] << 16));
+	h = tile_sig(h, BG, ((WX + 7) >> 3) + 1);
+
+	MIX(h, WX);
+	if (WX < 160)
+	{
+		MIX(h, (WT << 8) | WV);
+		row = (((R_LCDC&0x40) ? 0x400 : 0) + (WT << 5)) >> 5;
+		MIX(h, mapgen[0][row] | (mapgen[1][row] << 16));
+		h = tile_sig(h, WND, ((160 - WX) >> 3) + 1);
+	}
+
+	MIX(h, NS);
+	for (i = 0; i < NS; i++)
+	{
+		MIX(h, (VS[i].pat << 16) | (VS[i].x & 0xffff));
+		MIX(h, (VS[i].v << 16) | (VS[i].pal << 8) | VS[i].pri);
+		MIX(h, tilegen[(VS[i].pat >> 9) & 1][VS[i].pat & 0x1ff]);
+	}
+
+	if (!h) h = 1;
+
+	if (lastsig[L] != h)
+	{
+		lastsig[L] = h;
+		dirty[L >> 5] |= 1u << (L & 31);
+	}
+	if (cursig[L] == h) return 0;
+	cursig[L] = h;
+	return 1;
+}
+
+static un32 snapgen;
+
+/* colour indices the lines drawn so far use from each snapshot, as a
+ * 64-bit mask, and how many lines have been folded into it */
+static un32 snapused[FB_PAL_SNAPSHOTS][2];
+static int snaplines, snapcur;
+
+/* whether the lines drawn with snapshot s only use colours PAL2 has */
+static int snap_fits(struct fbpal *fp, int s)
+{
+	int i;
+
+	for (i = 0; i < 64; i++)
+		if ((snapused[s][i >> 5] & (1u << (i & 31))) && fp->pal[s][i] != PAL2[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Finds a snapshot PAL2 can be copied over without changing the lines
+ * already drawn with it. Raster effects mostly change colours the
+ * lines above do not use, or switch back to an earlier palette, so
+ * most frames never need more than a few snapshots.
+ */
+static int snap_reuse(struct fbpal *fp)
+{
+	int i, s;
+	const byte *p;
 
-	if ((frame % 2) == 0)
+	/* palette writes end deferred frames, so their lines are drawn */
+	if (lcd_deferred) return -1;
+	for (; snaplines < L; snaplines++)
+	{
+		s = fp->line[snaplines];
+		p = vframe + snaplines * fb.pitch;
+		for (i = 0; i < 160; i++)
+			snapused[s][p[i] >> 5] |= 1u << (p[i] & 31);
+	}
+
+	if (snap_fits(fp, snapcur)) return snapcur;
+	for (s = fp->count - 1; s >= 0; s--)
+		if (s != snapcur && snap_fits(fp, s)) return s;
+	return -1;
+}
+
+/* Records the palette in effect for L with an indexed framebuffer.
+ * When the palette changed a compatible snapshot is updated, or else
+ * a new one taken. With all of them taken the remaining lines keep
+ * the current one and show stale colours rather than repainting the
+ * lines above. */
+static void IRAM_ATTR line_pal()
+{
+	struct fbpal *fp = FB_PAL(vframe);
+	int s;
+
+	if (!fp->count)
+	{
+		memset(snapused, 0, sizeof snapused);
+		snaplines = 0;
+		s = fp->count++;
+	}
+	else if (snapgen == palgen)
+		s = -1;
+	else if ((s = snap_reuse(fp)) < 0 && fp->count < FB_PAL_SNAPSHOTS)
+		s = fp->count++;
+	else if (s < 0)
+		lcd_stats.pal_overflows++;
+
+	snapgen = palgen;
+	if (s >= 0)
+	{
+		memcpy(fp->pal[s], PAL2, sizeof PAL2);
+		snapcur = s;
+	}
+	fp->line[L] = snapcur;
+}
+
+static void fb_clear(byte *p)
+{
+	struct fbpal *fp;
+
+	if (!fb.indexed)
+	{
+		memset(p, 0xff, fb.h * fb.pitch);
+		return;
+	}
+
+	memset(p, 0, fb.h * fb.pitch);
+	fp = FB_PAL(p);
+	fp->pal[0][0] = 0xffff;
+	fp->count = 1;
+	memset(fp->line, 0, sizeof fp->line);
+}
+
+/* Without framebuffers to blank, beam mode sends a blank frame band
+ * by band when the LCD is switched off. */
+static void band_blank()
+{
+	int y, n;
+
+	for (y = 0; y < fb.h; y += n)
+	{
+		n = fb.h - y < fb.bandlines ? fb.h - y : fb.bandlines;
+		memset(fb.ptr, 0xff, n * fb.pitch);
+		fb.ptr = fb.band(fb.ptr, y, n);
+	}
+	vdest = fb.ptr;
+}
+
+static void IRAM_ATTR band_scan(int n, int need)
+{
+	int i, k;
+	int *tile;
+	const byte *src;
+
+	tile = BG;
+
+	for (i = 0; i < 21; i++)
+	{
+		if (hw.cgb)
+		{
+			for (k = 0; k < n; k++)
+				if (need & (1 << k))
+					cgb_run(band[k] + (i << 3), bandpri[k] + (i << 3), tile, V + k, 0, 8, 1);
+			tile += 2;
+		}
+		else
+		{
+			for (k = 0; k < n; k++)
+			{
+				if (!(need & (1 << k))) continue;
+				src = get_patpix(*tile, V + k);
+				((int *)(band[k] + (i << 3)))[0] = ((const int *)src)[0];
+				((int *)(band[k] + (i << 3)))[1] = ((const int *)src)[1];
+			}
+			tile++;
+		}
+	}
+}
+
+static void IRAM_ATTR lcd_render_deferred(int lines)
+{
+	int l, n, k, need;
+	int64_t start = esp_timer_get_time();
+
+	for (l = 0; l < lines; l += n)
+	{
+		L = l;
+		scan_setup();
+		n = 8 - V;
+		if (n > lines - l) n = lines - l;
+
+		bg_tilebuf(21);
+
+		need = 0;
+		for (k = 0; k < n; k++)
+		{
+			L = l + k;
+			scan_setup();
+			spr_enum();
+			if (WX < 160) wnd_tilebuf();
+			if (line_changed()) need |= 1 << k;
+		}
+		if (!need) continue;
+
+		/* the checks above left the band's last line set up */
+		L = l;
+		scan_setup();
+		band_scan(n, need);
+
+		for (k = 0; k < n; k++)
+		{
+			if (!(need & (1 << k))) continue;
+			L = l + k;
+			scan_setup();
+
+			memcpy(BUF, band[k] + U, 160);
+			spr_enum();
+			if (WX < 160) wnd_tilebuf();
+			if (hw.cgb)
+			{
+				if (NS) memcpy(PRI, bandpri[k] + U, 160);
+				cgb_scan(0);
+			}
+			else
+			{
+				wnd_scan();
+				recolor(BUF+WX, 0x04, 160-WX);
+			}
+			spr_scan();
+
+			line_out(vframe + L * fb.pitch);
+		}
+	}
+
+	lcd_stats.time += esp_timer_get_time() - start;
+}
+
+void IRAM_ATTR lcd_flush_deferred()
+{
+	lcd_deferred = 0;
+	lcd_render_deferred(deferred_lines);
+}
+
+/*
+ * A lag frame is one in which the game neither read the joypad nor
+ * changed anything the LCD shows, typically because its logic runs
+ * slower than 60 Hz or it is loading. If nothing changed since the last
+ * frame that was drawn either, a deferred frame is not drawn at all and
+ * lcd_lagframe tells the display side there is nothing new to present.
+ */
+un32 lcd_vgen;
+int lcd_lagframe;
+static un32 vgen_frame, vgen_drawn;
+
+void IRAM_ATTR lcd_endframe()
+{
+	int i, lag;
+
+	lag = !hw.padreads && lcd_vgen == vgen_frame;
+	hw.padreads = 0;
+	vgen_frame = lcd_vgen;
+	if (lag) lcd_stats.frames_lag++;
+
+	if (!rendering) return;
+	rendering = 0;
+
+	if (lcd_deferred)
+	{
+		lcd_deferred = 0;
+		if (lag && lcd_vgen == vgen_drawn && !fb.blend)
+		{
+			lcd_lagframe = 1;
+			return;
+		}
+		lcd_render_deferred(deferred_lines);
+		lcd_stats.frames_deferred++;
+	}
+	vgen_drawn = lcd_vgen;
+
+	for (i = 0; i < LCD_DIRTY_WORDS; i++)
+		lcd_dirty[i] |= dirty[i];
+	memset(dirty, 0, sizeof dirty);
+}
+
+void IRAM_ATTR lcd_refreshline()
+{
+	int i;
+	int64_t start;
+
+	if ((frame % 7) == 0 && !fb.blend) ++frame;
+
+
+	L = R_LY;
+	scan_setup();
+
+	if ((frame % 2) == 0 || fb.blend)
 	{
 		if (!(R_LCDC & 0x80))
 		{
+			lcd_lagframe = 0;
 			if (!lastLcdDisabled)
 			{
-				memset(displayBuffer[0], 0xff, 144 * 160 * 2);
-				memset(displayBuffer[1], 0xff, 144 * 160 * 2);
+				memset(blanked, 0, sizeof blanked);
+				sig_invalidate();
+				memset(lcd_dirty, 0xff, sizeof lcd_dirty);
 
 				lastLcdDisabled = 1;
+				if (fb.band) band_blank();
+			}
+
+			for (i = 0; i < FB_COUNT && !fb.band; i++)
+			{
+				if (blanked[i] == fb.ptr) break;
+				if (blanked[i]) continue;
+				blanked[i] = fb.ptr;
+				fb_clear(fb.ptr);
+				if (fb.blend) fb_clear(fb.ptr + FB_SIZE());
+				break;
 			}
 
 			return;
@@ -684,19 +1072,46 @@ void IRAM_ATTR lcd_refreshline()
 
 		lastLcdDisabled = 0;
 
+		if (L == 0)
+		{
+			vdest = vframe = fb.ptr;
+			if (frame % 2)
+			{
+				vdest = vframe = fb.ptr + FB_SIZE();
+				lcd_stats.frames_blend++;
+			}
+			lcd_stats.frames++;
+			lcd_lagframe = 0;
+			lcd_deferred = defer && !fb.band;
+			rendering = 1;
+			bandstart = 0;
+			sig_select();
+			if (fb.indexed) FB_PAL(vframe)->count = 0;
+		}
+
+		if (fb.indexed) line_pal();
 
+		if (lcd_deferred)
+		{
+			deferred_lines = L + 1;
+			vdest += fb.pitch;
+			return;
+		}
+
+		start = esp_timer_get_time();
 		spr_enum();
 		tilebuf();
 
+		if (!line_changed() && !fb.band)
+		{
+			lcd_stats.time += esp_timer_get_time() - start;
+			vdest += fb.pitch;
+			return;
+		}
+
 		if (hw.cgb)
 		{
-			bg_scan_color();
-			wnd_scan_color();
-			if (NS)
-			{
-				bg_scan_pri();
-				wnd_scan_pri();
-			}
+			cgb_scan(1);
 		}
 		else
 		{
@@ -706,27 +1121,104 @@ void IRAM_ATTR lcd_refreshline()
 		}
 		spr_scan();
 
-		dest = vdest;
-
-		int cnt = 160;
-		un16* dst = (un16*)dest;
-		byte* src = BUF;
+		line_out(vdest);
+		lcd_stats.time += esp_timer_get_time() - start;
 
-		while (cnt--) *(dst++) = PAL2[*(src++)];
+		if (fb.band && (L + 1 - bandstart == fb.bandlines || L == 143))
+		{
+			fb.ptr = fb.band(vdest - (L - bandstart) * fb.pitch, bandstart, L + 1 - bandstart);
+			vdest = fb.ptr;
+			bandstart = L + 1;
+			return;
+		}
 	}
 
 	vdest += fb.pitch;
 }
 
-inline static void updatepalette(int i)
+/*
+ * CGB colour correction. Colours are corrected when palette RAM
+ * changes, never per pixel. A profile linearises each 5-bit channel
+ * with the LCD's gamma, mixes the three channels and maps the sums
+ * back through the output gamma. Both steps are tables: cc_mix holds
+ * every channel value's weighted share of each output channel and
+ * cc_out the output curve, so a palette write is nine loads and adds.
+ * Given a 32768-entry table, lcd_cc_set() precomputes the whole
+ * mapping into it instead and a palette write is a single load; the
+ * caller decides which memory that table lives in.
+ */
+
+#define CC_STEPS 1024
+
+static const struct
 {
-	short c;
-	short r, g, b; //, y, u, v, rr, gg;
+	const char *name;
+	float gamma;      /* of the emulated LCD */
+	short mix[3][3];  /* r, g, b from r, g, b in 1/256 */
+	float out_gamma;
+	short bright;     /* white level out of 255 */
+} cc_profiles[LCD_CC_COUNT] =
+{
+	{ "Raw", 1.0f, { { 256, 0, 0 }, { 0, 256, 0 }, { 0, 0, 256 } }, 1.0f, 255 },
+	{ "GBC LCD", 1.0f, { { 208, 32, 16 }, { 0, 192, 64 }, { 48, 32, 176 } }, 1.0f, 240 },
+	{ "GBA SP", 2.2f, { { 220, 30, 6 }, { 10, 230, 16 }, { 6, 24, 226 } }, 2.2f, 255 },
+};
 
-	short low = lcd.pal[i << 1];
-	short high = lcd.pal[(i << 1) | 1];
+static int cc_profile = LCD_CC_RAW;
+static un16 cc_mix[3][3][32];
+static byte cc_out[CC_STEPS];
+static un16 *cc_table;
 
-	c = (low | (high << 8)) & 0x7fff;
+static un16 cc_color(int c)
+{
+	int o, s, rgb[3];
+	int ch[3] = { c & 0x1f, (c >> 5) & 0x1f, (c >> 10) & 0x1f };
+
+	for (o = 0; o < 3; o++)
+	{
+		s = cc_mix[o][0][ch[0]] + cc_mix[o][1][ch[1]] + cc_mix[o][2][ch[2]];
+		if (s > CC_STEPS - 1) s = CC_STEPS - 1;
+		rgb[o] = cc_out[s];
+	}
+	return ((rgb[0] >> 3) << 11) | ((rgb[1] >> 2) << 5) | (rgb[2] >> 3);
+}
+
+const char *lcd_cc_name(int profile)
+{
+	if (profile < 0 || profile >= LCD_CC_COUNT) return "?";
+	return cc_profiles[profile].name;
+}
+
+void lcd_cc_set(int profile, un16 *table)
+{
+	int o, i, v;
+	float lin;
+
+	if (profile < 0 || profile >= LCD_CC_COUNT) profile = LCD_CC_RAW;
+	cc_profile = profile;
+
+	for (v = 0; v < 32; v++)
+	{
+		lin = powf(v / 31.0f, cc_profiles[profile].gamma) * (CC_STEPS - 1);
+		for (o = 0; o < 3; o++)
+			for (i = 0; i < 3; i++)
+				cc_mix[o][i][v] = (un16)(lin * cc_profiles[profile].mix[o][i] / 256 + 0.5f);
+	}
+	for (v = 0; v < CC_STEPS; v++)
+		cc_out[v] = (byte)(powf(v / (float)(CC_STEPS - 1), 1.0f / cc_profiles[profile].out_gamma)
+			* cc_profiles[profile].bright + 0.5f);
+
+	cc_table = table;
+	if (cc_table && cc_profile != LCD_CC_RAW)
+		for (v = 0; v < 32768; v++)
+			cc_table[v] = cc_color(v);
+
+	pal_dirty();
+}
+
+static un16 cc_raw(int c)
+{
+	short r, g, b;
 
 	//bit 0-4 red
 	r = c & 0x1f;
@@ -737,13 +1229,35 @@ inline static void updatepalette(int i)
 	// bit 10-14 blue
 	b = (c >> 10) & 0x1f;
 
-	PAL2[i] = (r << 11) | (g << (5 + 1)) | (b);
+	return (r << 11) | (g << (5 + 1)) | (b);
+}
+
+/* the RGB565 colour CGB palette entry c is shown in with the current profile */
+un16 IRAM_ATTR lcd_cc_color(int c)
+{
+	if (cc_profile == LCD_CC_RAW) return cc_raw(c);
+	return cc_table ? cc_table[c] : cc_color(c);
+}
+
+inline static void updatepalette(int i)
+{
+	short c;
+
+	short low = lcd.pal[i << 1];
+	short high = lcd.pal[(i << 1) | 1];
+
+	c = (low | (high << 8)) & 0x7fff;
+
+	palgen++;
+
+	PAL2[i] = hw.cgb ? lcd_cc_color(c) : cc_raw(c);
 }
 
 inline void pal_write(int i, byte b)
 {
 	if (lcd.pal[i] != b)
 	{
+		LCD_RASTER_CHANGE();
 		lcd.pal[i] = b;
 		updatepalette(i>>1);
 	}
@@ -751,53 +1265,99 @@ inline void pal_write(int i, byte b)
 
 void IRAM_ATTR pal_write_dmg(int i, int mapnum, byte d)
 {
-	int j;
-	int * const cmap = dmg_pal[mapnum & 0x3];
-	int c;
-	int r, g, b;
+	un16 * const shade = dmg_shade[mapnum & 0x3];
+	un16 *dst = PAL2 + (i >> 1);
+	un16 c0, c1, c2, c3;
 
 	if (hw.cgb) return;
 
-	for (j = 0; j < 8; j += 2)
-	{
-		c = cmap[(d >> j) & 3];
-		r = (c & 0xf8) >> 3;
-		g = (c & 0xf800) >> 6;
-		b = (c & 0xf80000) >> 9;
-		c = r | g | b;
+	c0 = shade[d & 3];
+	c1 = shade[(d >> 2) & 3];
+	c2 = shade[(d >> 4) & 3];
+	c3 = shade[(d >> 6) & 3];
+	if (dst[0] == c0 && dst[1] == c1 && dst[2] == c2 && dst[3] == c3)
+		return;
 
-		/* FIXME - handle directly without faking cgb */
-		pal_write(i+j, c & 0xff);
-		pal_write(i+j+1, c >> 8);
-	}
+	LCD_RASTER_CHANGE();
+	dst[0] = c0;
+	dst[1] = c1;
+	dst[2] = c2;
+	dst[3] = c3;
+	palgen++;
+}
 
-	//printf("pal_write_dmg: i=%d, d=0x%x\n", i , d);
+const char *lcd_dmg_preset_name(int n)
+{
+	if (n < 0 || n >= LCD_DMG_PRESETS) return "?";
+	return dmg_presets[n].name;
 }
 
-inline void vram_write(int a, byte b)
+void lcd_dmg_palette(const int pal[4][4])
 {
-	//if (lcd.vbank[R_VBK&1][a] != b)
+	int i, j, c;
+
+	for (i = 0; i < 4; i++)
 	{
-		lcd.vbank[R_VBK&1][a] = b;
-		if (a >= 0x1800) return;
+		for (j = 0; j < 4; j++)
+		{
+			c = pal[i][j];
+			dmg_shade[i][j] = ((c & 0xf8) << 8) | ((c & 0xfc00) >> 5) | ((c & 0xf80000) >> 19);
+		}
 	}
+	dmg_shade_set = 1;
+	pal_dirty();
+}
+
+void lcd_dmg_preset(int n)
+{
+	if (n < 0 || n >= LCD_DMG_PRESETS) n = 0;
+	lcd_dmg_palette(dmg_presets[n].pal);
+}
+
+inline void vram_write(int a, byte b)
+{
+	byte *p = &lcd.vbank[R_VBK&1][a];
+
+	if (*p == b) return;
+	LCD_RASTER_CHANGE();
+	*p = b;
+
+	if (a < 0x1800) tilegen[R_VBK&1][a >> 4]++;
+	else mapgen[R_VBK&1][(a - 0x1800) >> 5]++;
+}
+
+inline void oam_write(int a, byte b)
+{
+	if (lcd.oam.mem[a] == b) return;
+	LCD_RASTER_CHANGE();
+	lcd.oam.mem[a] = b;
 }
 
 void vram_dirty()
 {
+	sig_invalidate();
+	lcd_vgen++;
 }
 
 void pal_dirty()
 {
 	int i;
+
+	lcd_vgen++;
 	if (!hw.cgb)
 	{
+		if (!dmg_shade_set)
+		{
+			lcd_dmg_preset(0);
+			return;
+		}
 		pal_write_dmg(0, 0, R_BGP);
 		pal_write_dmg(8, 1, R_BGP);
 		pal_write_dmg(64, 2, R_OBP0);
 		pal_write_dmg(72, 3, R_OBP1);
+		palgen++;
 	}
-	//else
+	else
 	{
 		for (i = 0; i < 64; i++)
 		{
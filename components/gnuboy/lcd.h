@@ -43,16 +43,59 @@ struct lcd
 	byte pal[128];
 };
 
+struct lcd_stats
+{
+	int frames;          /* frames rendered */
+	int frames_deferred; /* of which rendered whole at vblank */
+	int pal_overflows;   /* palette changes no snapshot was left for */
+	int frames_blend;    /* of which only drawn to be blended */
+	int lines;           /* lines drawn, skipped unchanged ones excluded */
+	int frames_lag;      /* frames without P1 reads or video changes */
+	un32 time;           /* microseconds spent drawing, wraps */
+};
+
+/* CGB colour correction profiles for lcd_cc_set() */
+#define LCD_CC_RAW    0
+#define LCD_CC_GBC    1
+#define LCD_CC_GBA_SP 2
+#define LCD_CC_COUNT  3
+
+/* built-in DMG palettes for lcd_dmg_preset() */
+#define LCD_DMG_PRESETS 5
+
+/* one bit per line that changed since the display side last cleared
+ * lcd_dirty[]; rendered frames only ever add bits */
+#define LCD_DIRTY_WORDS ((144 + 31) / 32)
+
 extern struct lcd lcd;
 extern struct scan scan;
+extern struct lcd_stats lcd_stats;
+extern int lcd_deferred;
+extern un32 lcd_vgen;
+extern int lcd_lagframe;
+extern un32 lcd_dirty[LCD_DIRTY_WORDS];
+
+/* Must be called before any state the renderer reads changes, so
+ * that lines still pending from a deferred frame see the old state.
+ * lcd_vgen counts these changes for lag frame detection. */
+#define LCD_RASTER_CHANGE() do { lcd_vgen++; if (lcd_deferred) lcd_flush_deferred(); } while (0)
 
 
 void lcd_begin();
 void lcd_refreshline();
+void lcd_endframe();
+void lcd_flush_deferred();
 void pal_write(int i, byte b);
 void pal_write_dmg(int i, int mapnum, byte d);
 void vram_write(int a, byte b);
+void oam_write(int a, byte b);
 void pal_dirty();
+void lcd_cc_set(int profile, un16 *table);
+const char *lcd_cc_name(int profile);
+un16 lcd_cc_color(int c);
+void lcd_dmg_palette(const int pal[4][4]);
+void lcd_dmg_preset(int n);
+const char *lcd_dmg_preset_name(int n);
 void vram_dirty();
 void lcd_reset();
 //void bg_scan_color();
@@ -75,6 +75,7 @@ static void IRAM_ATTR stat_change(int stat)
 void IRAM_ATTR lcdc_change(byte b)
 {
 	byte old = R_LCDC;
+	if (old != b) LCD_RASTER_CHANGE();
 	R_LCDC = b;
 	if ((R_LCDC ^ old) & 0x80) /* lcd on/off change */
 	{
@@ -230,6 +231,7 @@ void IRAM_ATTR lcdc_trans()
 			/* hblank -> */
 			if (++R_LY >= 144)
 			{
+				lcd_endframe();
 				/* FIXME: pick _one_ place to trigger vblank interrupt
 				this better be done here or within stat_change(),
 				otherwise CPU will have a chance to run	for some time
@@ -144,10 +144,18 @@ void IRAM_ATTR ioreg_write(byte r, byte b)
 		case RI_TIMA:
 		case RI_TMA:
 		case RI_TAC:
+		REG(r) = b;
+		break;
+		case RI_WY:
+		/* latched at the start of a frame, so no raster change */
+		if (REG(r) != b) lcd_vgen++;
+		REG(r) = b;
+		break;
 		case RI_SCY:
 		case RI_SCX:
-		case RI_WY:
 		case RI_WX:
+		if (REG(r) == b) break;
+		LCD_RASTER_CHANGE();
 		REG(r) = b;
 		break;
 		case RI_BGP:
@@ -275,6 +283,8 @@ byte IRAM_ATTR ioreg_read(byte r)
 		R_SC &= 0x7f;
 		return r;
 		case RI_P1:
+		hw.padreads++;
+		return REG(r);
 		case RI_SB:
 		case RI_DIV:
 		case RI_TIMA:
@@ -539,7 +549,7 @@ void IRAM_ATTR mem_write(int a, byte b)
 		if ((a & 0xFF00) == 0xFE00)
 		{
 			/* if (R_STAT & 0x02) break; */
-			if (a < 0xFEA0) lcd.oam.mem[a & 0xFF] = b;
+			if (a < 0xFEA0) oam_write(a & 0xFF, b);
 			break;
 		}
 		/* return writehi(a & 0xFF, b); */
@@ -6,15 +6,63 @@
 #include "defs.h"
 #include <stdint.h>
 
+/*
+ * Single producer, single consumer ring of samples: the mixer writes at
+ * head, the host's audio task reads at tail. Both positions run free in
+ * samples and are only written by their owner, so no locks are needed.
+ */
 struct pcm
 {
-	int hz, len;
+	int hz, len; /* len is the ring size in samples, a power of two */
 	int stereo;
 	int16_t* buf;
-	int pos;
+	int volume; /* output gain, 256 is unity */
+	int target; /* fill the rate control steers towards, 0 for none */
+	int (*queued)(); /* samples the reader took but has not played yet, may be NULL */
+	unsigned head, tail;
+	unsigned overflows; /* frames dropped on a full ring */
+	unsigned underflows; /* times the reader found less than it needed */
 };
 
 extern struct pcm pcm;
 
+/* Samples queued, safe from either side */
+static inline int pcm_fill()
+{
+	return __atomic_load_n(&pcm.head, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&pcm.tail, __ATOMIC_ACQUIRE);
+}
+
+/* Samples buffered ahead of the output, in the ring and past it */
+static inline int pcm_buffered()
+{
+	return pcm_fill() + (pcm.queued ? pcm.queued() : 0);
+}
+
+/* Producer: room left, and publishing n samples written from head */
+static inline int pcm_space()
+{
+	return pcm.len - (pcm.head - __atomic_load_n(&pcm.tail, __ATOMIC_ACQUIRE));
+}
+
+static inline void pcm_commit(int n)
+{
+	__atomic_store_n(&pcm.head, pcm.head + n, __ATOMIC_RELEASE);
+}
+
+/* Consumer: the contiguous run of samples at tail, and releasing them */
+static inline int16_t *pcm_peek(int *count)
+{
+	int n = __atomic_load_n(&pcm.head, __ATOMIC_ACQUIRE) - pcm.tail;
+	int run = pcm.len - (pcm.tail & (pcm.len - 1));
+	*count = n < run ? n : run;
+	return pcm.buf + (pcm.tail & (pcm.len - 1));
+}
+
+static inline void pcm_release(int n)
+{
+	__atomic_store_n(&pcm.tail, pcm.tail + n, __ATOMIC_RELEASE);
+}
+
 
 #endif
@@ -106,6 +106,7 @@ struct svar svars[] =
 	I4("S4p ", &snd.ch[3].pos),
 	I4("S4c ", &snd.ch[3].cnt),
 	I4("S4ec", &snd.ch[3].encnt),
+	I4("Sseq", &snd.seq),
 
 	I4("hdma", &hw.hdma),
 
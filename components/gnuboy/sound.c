@@ -1,6 +1,7 @@
 #pragma GCC optimize ("O3")
 
 #include <string.h>
+#include <math.h>
 
 #include "gnuboy.h"
 #include "defs.h"
@@ -11,8 +12,10 @@
 #include "regs.h"
 #include "rc.h"
 #include "noise.h"
+#include "blip.h"
 
 #include <esp_attr.h>
+#include <xtensa/hal.h>
 #include "freertos/FreeRTOS.h"
 
 static const byte DRAM_ATTR dmgwave[16] =
@@ -52,6 +55,20 @@ static const int DRAM_ATTR freqtab[8] =
 };
 
 struct snd snd;
+struct sound_stats sound_stats;
+int sound_engine = SOUND_STEP;
+int sound_rate = 3; /* 32000Hz */
+
+const int sound_rates[SOUND_RATES] =
+{
+	11025, 16000, 22050, 32000, 44100, 48000
+};
+
+static const char *engine_names[SOUND_ENGINES] =
+{
+	"Stepped",
+	"Band-limited"
+};
 
 #define RATE (snd.rate)
 #define WAVE (snd.wave) /* ram.hi+0x30 */
@@ -60,16 +77,60 @@ struct snd snd;
 #define S3 (snd.ch[2])
 #define S4 (snd.ch[3])
 
+#define SEQ_PERIOD 4096 /* 2MHz units per 512Hz frame sequencer tick */
+
+/* The mixer works from its own copy of NR10-NR52 rather than ram.hi, so
+   in deferred mode the synth core never touches what the CPU sees; in
+   direct mode the copy is mirrored back after every write and mix */
+#undef REG
+#define REG(n) (snd.reg[(n)])
+
+/*
+ * Deferred mode: the CPU side only stamps register writes into a single
+ * producer, single consumer log and answers reads from ram.hi, keeping
+ * a cheap model of which channels NR52 reports as playing. The host runs
+ * sound_synth() on the other core, which renders up to each write's
+ * 2MHz timestamp before applying it.
+ */
+#define LOG_SIZE 2048 /* records in flight, a power of two */
+#define LOG_SPINS 1000 /* polls of a full log before sleeping between them */
+#define LOG_SPAN (1<<17) /* longest stamp before a span has to be closed */
+
+int sound_deferred;
+void (*sound_notify)();
+
+static struct
+{
+	un32 buf[LOG_SIZE]; /* time<<14 | register<<8 | value, register 0 ends a span */
+	unsigned head, tail;
+	int now; /* synth side: units rendered of the current span */
+} reglog;
+
+static struct
+{
+	unsigned clock; /* units up to the start of the current span */
+	unsigned start[4]; /* when each channel was last triggered */
+	int on;
+} shadow;
+
 rcvar_t sound_exports[] =
 {
 	RCV_END
 };
 
 
+/* Phase step per output sample for a waveform advancing 1<<bits per
+   2MHz unit over d, exact at the output rate rather than at RATE */
+inline static int phase_step(int bits, int d)
+{
+	if (!snd.hz) return 0;
+	return ((long long)1 << (21 + bits)) / ((long long)snd.hz * d);
+}
+
 inline static void s1_freq_d(int d)
 {
 	if (RATE > (d<<4)) S1.freq = 0;
-	else S1.freq = (RATE << 17)/d;
+	else S1.freq = phase_step(17, d);
 }
 
 inline static void s1_freq()
@@ -81,23 +142,30 @@ inline static void s2_freq()
 {
 	int d = 2048 - (((R_NR24&7)<<8) + R_NR23);
 	if (RATE > (d<<4)) S2.freq = 0;
-	else S2.freq = (RATE << 17)/d;
+	else S2.freq = phase_step(17, d);
 }
 
 inline static void s3_freq()
 {
 	int d = 2048 - (((R_NR34&7)<<8) + R_NR33);
 	if (RATE > (d<<3)) S3.freq = 0;
-	else S3.freq = (RATE << 21)/d;
+	else S3.freq = phase_step(21, d);
 }
 
 inline static void s4_freq()
 {
-	S4.freq = (freqtab[R_NR43&7] >> (R_NR43 >> 4)) * RATE;
-	if (S4.freq >> 18) S4.freq = 1<<18;
+	long long f;
+	if (!snd.hz) return;
+	f = ((long long)(freqtab[R_NR43&7] >> (R_NR43 >> 4)) << 21) / snd.hz;
+	S4.freq = f >> 18 ? 1<<18 : f;
 }
 
-void sound_dirty()
+static void mirror()
+{
+	memcpy(ram.hi + RI_NR10, snd.reg + RI_NR10, RI_NR52 - RI_NR10 + 1);
+}
+
+static void chan_dirty()
 {
 	S1.swlen = ((R_NR10>>4) & 7) << 14;
 	S1.len = (64-(R_NR11&63)) << 13;
@@ -112,7 +180,7 @@ void sound_dirty()
 	S2.endir |= S2.endir - 1;
 	S2.enlen = (R_NR22 & 7) << 15;
 	s2_freq();
-	S3.len = (256-R_NR31) << 20;
+	S3.len = (256-R_NR31) << 13;
 	s3_freq();
 	S4.len = (64-(R_NR41&63)) << 13;
 	S4.envol = R_NR42 >> 4;
@@ -122,184 +190,973 @@ void sound_dirty()
 	s4_freq();
 }
 
+void sound_dirty()
+{
+	int i;
+
+	memcpy(snd.reg + RI_NR10, ram.hi + RI_NR10, RI_NR52 - RI_NR10 + 1);
+	chan_dirty();
+	shadow.on = S1.on | (S2.on<<1) | (S3.on<<2) | (S4.on<<3);
+	for (i = 0; i < 4; i++)
+		shadow.start[i] = shadow.clock - snd.ch[i].cnt;
+}
+
+/* What the registers read back as once NR52 switches the APU off */
+static void regs_off(byte *hi)
+{
+	hi[RI_NR10] = 0x80;
+	hi[RI_NR11] = 0xBF;
+	hi[RI_NR12] = 0xF3;
+	hi[RI_NR14] = 0xBF;
+	hi[RI_NR21] = 0x3F;
+	hi[RI_NR22] = 0x00;
+	hi[RI_NR24] = 0xBF;
+	hi[RI_NR30] = 0x7F;
+	hi[RI_NR31] = 0xFF;
+	hi[RI_NR32] = 0x9F;
+	hi[RI_NR34] = 0xBF;
+	hi[RI_NR41] = 0xFF;
+	hi[RI_NR42] = 0x00;
+	hi[RI_NR43] = 0x00;
+	hi[RI_NR44] = 0xBF;
+	hi[RI_NR50] = 0x77;
+	hi[RI_NR51] = 0xF3;
+	hi[RI_NR52] = 0x70;
+}
+
 void sound_off()
 {
 	memset(&S1, 0, sizeof S1);
 	memset(&S2, 0, sizeof S2);
 	memset(&S3, 0, sizeof S3);
 	memset(&S4, 0, sizeof S4);
-	R_NR10 = 0x80;
-	R_NR11 = 0xBF;
-	R_NR12 = 0xF3;
-	R_NR14 = 0xBF;
-	R_NR21 = 0x3F;
-	R_NR22 = 0x00;
-	R_NR24 = 0xBF;
-	R_NR30 = 0x7F;
-	R_NR31 = 0xFF;
-	R_NR32 = 0x9F;
-	R_NR34 = 0xBF;
-	R_NR41 = 0xFF;
-	R_NR42 = 0x00;
-	R_NR43 = 0x00;
-	R_NR44 = 0xBF;
-	R_NR50 = 0x77;
-	R_NR51 = 0xF3;
-	R_NR52 = 0x70;
-	sound_dirty();
+	regs_off(snd.reg);
+	chan_dirty();
 }
 
+static void rate_dirty();
+
 void sound_reset()
 {
 	memset(&snd, 0, sizeof snd);
-	if (pcm.hz) snd.rate = (1<<21) / pcm.hz;//(1<<21) / pcm.hz;
-	else snd.rate = 0;
+	snd.seq = SEQ_PERIOD;
+	rate_dirty();
 	memcpy(WAVE, hw.cgb ? cgbwave : dmgwave, 16);
 	memcpy(ram.hi+0x30, WAVE, 16);
 	sound_off();
 	R_NR52 = 0xF1;
+	mirror();
+	memset(&reglog, 0, sizeof reglog);
+	memset(&shadow, 0, sizeof shadow);
 }
 
 
-void IRAM_ATTR sound_mix()
+void sound_engine_set(int engine)
 {
-	int s, l, r, f, n;
+	int i;
+	if (engine < 0 || engine >= SOUND_ENGINES) engine = SOUND_STEP;
+	sound_engine = engine;
+	rate_dirty();
+	for (i = 0; i < 4; i++)
+		snd.blep[i].l = snd.blep[i].r = 0;
+}
+
+const char *sound_engine_name(int engine)
+{
+	return engine_names[engine];
+}
+
+/* The band-limited engine is filtered at whatever rate it runs, so it
+   mixes at the output rate. The stepped one aliases, so lower rates mix
+   at up to twice the output rate, but no faster than the 32kHz it has
+   always run at, and the resampler's low-pass takes the rest off */
+static int mix_hz(int hz, int engine)
+{
+	if (engine == SOUND_STEP && hz < 32000)
+		return hz * 2 < 32000 ? hz * 2 : 32000;
+	return hz;
+}
+
+int sound_mix_hz(int rate, int engine)
+{
+	return mix_hz(sound_rates[rate], engine);
+}
+
+void sound_rate_set(int rate)
+{
+	if (rate < 0 || rate >= SOUND_RATES) rate = 3;
+	sound_rate = rate;
+	pcm.hz = sound_rates[rate];
+	rate_dirty();
+}
 
-	if (!RATE || cpu.snd < RATE) return;
 
-	for (; cpu.snd >= RATE; cpu.snd -= RATE)
+/* 512Hz frame sequencer: the length, envelope and sweep counters move
+   in whole ticks, the way the hardware clocks them */
+inline static void seq_channel(struct sndchan *c, int counted)
+{
+	if (counted && (c->cnt += SEQ_PERIOD) >= c->len)
+		c->on = 0;
+	if (c->enlen && (c->encnt += SEQ_PERIOD) >= c->enlen)
 	{
-		l = r = 0;
+		c->encnt -= c->enlen;
+		c->envol += c->endir;
+		if (c->envol < 0) c->envol = 0;
+		if (c->envol > 15) c->envol = 15;
+	}
+}
+
+static void IRAM_ATTR sound_sequencer()
+{
+	int f, n;
 
-		if (S1.on)
+	if (S1.on)
+	{
+		seq_channel(&S1, R_NR14 & 64);
+		if (S1.swlen && (S1.swcnt += SEQ_PERIOD) >= S1.swlen)
 		{
-			s = sqwave[R_NR11>>6][(S1.pos>>18)&7] & S1.envol;
-			S1.pos += S1.freq;
-			if ((R_NR14 & 64) && ((S1.cnt += RATE) >= S1.len))
+			S1.swcnt -= S1.swlen;
+			f = S1.swfreq;
+			n = (R_NR10 & 7);
+			if (R_NR10 & 8) f -= (f >> n);
+			else f += (f >> n);
+			if (f > 2047)
 				S1.on = 0;
-			if (S1.enlen && (S1.encnt += RATE) >= S1.enlen)
+			else
 			{
-				S1.encnt -= S1.enlen;
-				S1.envol += S1.endir;
-				if (S1.envol < 0) S1.envol = 0;
-				if (S1.envol > 15) S1.envol = 15;
+				S1.swfreq = f;
+				R_NR13 = f;
+				R_NR14 = (R_NR14 & 0xF8) | (f>>8);
+				s1_freq_d(2048 - f);
 			}
-			if (S1.swlen && (S1.swcnt += RATE) >= S1.swlen)
+		}
+	}
+	if (S2.on) seq_channel(&S2, R_NR24 & 64);
+	if (S3.on) seq_channel(&S3, R_NR34 & 64);
+	if (S4.on) seq_channel(&S4, R_NR44 & 64);
+}
+
+
+#define MIX_BLOCK 256
+
+static int mixl[MIX_BLOCK], mixr[MIX_BLOCK];
+
+/* Whether a channel is routed to a side whose NR50 level is not zero */
+inline static int audible(int ch)
+{
+	return ((R_NR51 & (16<<ch)) && (R_NR50 & 0x07))
+		|| ((R_NR51 & (1<<ch)) && (R_NR50 & 0x70));
+}
+
+/* The channels that would add anything to the mix right now, one bit
+   each; the others only need their phase moved on */
+static int IRAM_ATTR heard()
+{
+	int m = 0;
+
+	if (!pcm.volume) return 0;
+	if (S1.on && S1.envol && audible(0)) m |= 1;
+	if (S2.on && S2.envol && audible(1)) m |= 2;
+	if (S3.on && (R_NR32 & 96) && audible(2)) m |= 4;
+	if (S4.on && S4.envol && audible(3)) m |= 8;
+	return m;
+}
+
+/* Moves on a channel that cannot be heard, without sampling it */
+static void skip(struct sndchan *c, int n)
+{
+	if (!c->on) return;
+	c->pos += c->freq * n;
+	sound_stats.idle += n;
+}
+
+/* Each channel that can be heard adds its block of samples to the
+   accumulators in turn, the inner loops only step the phase and look
+   up the waveform */
+static void IRAM_ATTR mix_block(int n, int heard)
+{
+	int i, s, vol, ml, mr;
+	unsigned pos, freq;
+	const byte *wave, *bits;
+
+	if (!(heard & 1)) skip(&S1, n);
+	if (!(heard & 2)) skip(&S2, n);
+	if (!(heard & 4)) skip(&S3, n);
+	if (!(heard & 8)) skip(&S4, n);
+	if (!heard) return;
+
+	memset(mixl, 0, n * sizeof *mixl);
+	memset(mixr, 0, n * sizeof *mixr);
+
+	if (heard & 1)
+	{
+		wave = sqwave[R_NR11>>6];
+		vol = S1.envol;
+		pos = S1.pos;
+		freq = S1.freq;
+		ml = -((R_NR51 >> 4) & 1);
+		mr = -(R_NR51 & 1);
+		for (i = 0; i < n; i++)
+		{
+			s = (wave[(pos>>18)&7] & vol) << 2;
+			pos += freq;
+			mixl[i] += s & ml;
+			mixr[i] += s & mr;
+		}
+		S1.pos = pos;
+	}
+
+	if (heard & 2)
+	{
+		wave = sqwave[R_NR21>>6];
+		vol = S2.envol;
+		pos = S2.pos;
+		freq = S2.freq;
+		ml = -((R_NR51 >> 5) & 1);
+		mr = -((R_NR51 >> 1) & 1);
+		for (i = 0; i < n; i++)
+		{
+			s = (wave[(pos>>18)&7] & vol) << 2;
+			pos += freq;
+			mixl[i] += s & ml;
+			mixr[i] += s & mr;
+		}
+		S2.pos = pos;
+	}
+
+	if (heard & 4)
+	{
+		pos = S3.pos;
+		freq = S3.freq;
+		vol = 3 - ((R_NR32>>5)&3);
+		ml = -((R_NR51 >> 6) & 1);
+		mr = -((R_NR51 >> 2) & 1);
+		for (i = 0; i < n; i++)
+		{
+			s = WAVE[(pos>>22) & 15];
+			if (pos & (1<<21)) s &= 15;
+			else s >>= 4;
+			s = (s - 8) << vol;
+			pos += freq;
+			mixl[i] += s & ml;
+			mixr[i] += s & mr;
+		}
+		S3.pos = pos;
+	}
+
+	if (heard & 8)
+	{
+		vol = S4.envol;
+		pos = S4.pos;
+		freq = S4.freq;
+		ml = -((R_NR51 >> 7) & 1);
+		mr = -((R_NR51 >> 3) & 1);
+		if (R_NR43 & 8)
+		{
+			bits = noise7;
+			for (i = 0; i < n; i++)
 			{
-				S1.swcnt -= S1.swlen;
-				f = S1.swfreq;
-				n = (R_NR10 & 7);
-				if (R_NR10 & 8) f -= (f >> n);
-				else f += (f >> n);
-				if (f > 2047)
-					S1.on = 0;
-				else
-				{
-					S1.swfreq = f;
-					R_NR13 = f;
-					R_NR14 = (R_NR14 & 0xF8) | (f>>8);
-					s1_freq_d(2048 - f);
-				}
+				s = 1 & (bits[(pos>>20)&15] >> (7-((pos>>17)&7)));
+				s = 3 * ((-s) & vol);
+				pos += freq;
+				mixl[i] += s & ml;
+				mixr[i] += s & mr;
+			}
+		}
+		else
+		{
+			bits = noise15;
+			for (i = 0; i < n; i++)
+			{
+				s = 1 & (bits[(pos>>20)&4095] >> (7-((pos>>17)&7)));
+				s = 3 * ((-s) & vol);
+				pos += freq;
+				mixl[i] += s & ml;
+				mixr[i] += s & mr;
 			}
-			s <<= 2;
-			if (R_NR51 & 1) r += s;
-			if (R_NR51 & 16) l += s;
 		}
+		S4.pos = pos;
+	}
+}
+
+/* Staged frames follow the last RS_TAPS of the block before, which the
+   polyphase filter reaches back into */
+#define RS_TAPS 16
+#define RS_PHASE_BITS 5
+#define RS_PHASES (1<<RS_PHASE_BITS)
+#define RS_KERNEL_BITS 14
+
+static int16_t staged[2 * (RS_TAPS + MIX_BLOCK)];
+static int16_t *const stage = staged + 2 * RS_TAPS;
+static short rs_kernel[RS_PHASES][RS_TAPS];
+
+/*
+ * Rate control: a linear-interpolating resampler between the mixer and
+ * the ring stretches or squeezes the output by up to 0.5%, steering the
+ * samples buffered ahead of the output towards pcm.target so the reader
+ * neither starves nor stalls. That counts what the reader has taken but
+ * not played yet: it drains the ring a whole buffer at a time, so the
+ * ring alone hides a reader running dry.
+ * Close to the target it settles on a step of exactly one frame, where
+ * it is just a one-frame delay and the mixer writes the ring directly,
+ * skipping its staging buffer. That only saves the copy on this side:
+ * the reader still copies from the ring into the output's own buffers.
+ * When the mixer runs faster than the output, a polyphase low-pass
+ * filter takes over from the interpolation and the same nudge scales
+ * the decimation step.
+ */
+#define DRC_RANGE 328 /* 0.5% of 1<<16 */
+#define DRC_SNAP 4096 /* phase error forgiven when locking to unity */
+#define DRC_BAND 4 /* dead band, as a fraction of the target */
+
+static struct
+{
+	unsigned pos; /* 16.16 position of the next output between frames */
+	int base; /* mixed frames per output frame, 16.16 */
+	int step, fill;
+	int l, r; /* the frame before stage[0] */
+} drc = { .pos = 0, .base = 1<<16, .step = 1<<16 };
+
+/* Windowed sinc rows, one per sub-frame phase, cutting off just under
+   the output's Nyquist frequency and each summing to 1<<RS_KERNEL_BITS */
+static void resampler_init()
+{
+	int p, k, sum;
+	double x, h, w, fc, row[RS_TAPS], total;
+	const double pi = 3.14159265358979;
+
+	drc.base = pcm.hz ? ((long long)snd.hz << 16) / pcm.hz : 1<<16;
+	drc.pos = 0;
+	memset(staged, 0, sizeof staged);
+	if (drc.base == 1<<16) return;
+
+	fc = 0.45 * pcm.hz / snd.hz;
+	for (p = 0; p < RS_PHASES; p++)
+	{
+		total = 0;
+		for (k = 0; k < RS_TAPS; k++)
+		{
+			x = RS_TAPS/2 - 1 - k + (double)p / RS_PHASES;
+			h = x ? sin(2*pi*fc*x) / (pi*x) : 2*fc;
+			w = 0.42 + 0.5*cos(pi*x / (RS_TAPS/2))
+				+ 0.08*cos(2*pi*x / (RS_TAPS/2));
+			row[k] = h * w;
+			total += row[k];
+		}
+		sum = 0;
+		for (k = 0; k < RS_TAPS; k++)
+		{
+			rs_kernel[p][k] = (short)floor(row[k] / total * (1<<RS_KERNEL_BITS) + 0.5);
+			sum += rs_kernel[p][k];
+		}
+		rs_kernel[p][RS_TAPS/2 - 1] += (1<<RS_KERNEL_BITS) - sum;
+	}
+}
+
+/* Derives the mixing rate from pcm.hz and the engine, and everything
+   that is stepped at it */
+static void rate_dirty()
+{
+	snd.hz = mix_hz(pcm.hz, sound_engine);
+	snd.rate = snd.hz ? (1<<21) / snd.hz : 0;
+	snd.frac = 0;
+	blip_init(snd.hz);
+	resampler_init();
+	s1_freq();
+	s2_freq();
+	s3_freq();
+	s4_freq();
+}
+
+/* Picks the step for the next block of n frames, true when it is
+   locked to unity */
+static int drc_update(int n)
+{
+	int fill = pcm_buffered(), nudge = 0, error, band;
 
-		if (S2.on)
+	if (pcm.target)
+	{
+		/* smoothed over about 2048 frames, however the blocks fall */
+		drc.fill += (fill - drc.fill) * n >> 11;
+		error = drc.fill - pcm.target;
+		band = pcm.target / DRC_BAND;
+		if (error < band && error > -band)
 		{
-			s = sqwave[R_NR21>>6][(S2.pos>>18)&7] & S2.envol;
-			S2.pos += S2.freq;
-			if ((R_NR24 & 64) && ((S2.cnt += RATE) >= S2.len))
-				S2.on = 0;
-			if (S2.enlen && (S2.encnt += RATE) >= S2.enlen)
+			/* inside the dead band, drift the phase onto a whole frame */
+			if (drc.base == 1<<16)
 			{
-				S2.encnt -= S2.enlen;
-				S2.envol += S2.endir;
-				if (S2.envol < 0) S2.envol = 0;
-				if (S2.envol > 15) S2.envol = 15;
+				if (((drc.pos + DRC_SNAP) & 0xffff) < 2 * DRC_SNAP)
+					drc.pos = (drc.pos + DRC_SNAP) & ~0xffff;
+				else nudge = -DRC_RANGE / 8;
 			}
-			s <<= 2;
-			if (R_NR51 & 2) r += s;
-			if (R_NR51 & 32) l += s;
 		}
+		else
+		{
+			/* from the edge of the band, the full nudge is reached a
+			   quarter of the target further out */
+			error += error > 0 ? -band : band;
+			nudge = DRC_RANGE * 4 * error / pcm.target;
+			if (nudge > DRC_RANGE) nudge = DRC_RANGE;
+			if (nudge < -DRC_RANGE) nudge = -DRC_RANGE;
+		}
+		sound_stats.fill += fill;
+		sound_stats.fill_error += fill > pcm.target ? fill - pcm.target : pcm.target - fill;
+		sound_stats.fill_count++;
+		if (nudge < sound_stats.step_min) sound_stats.step_min = nudge;
+		if (nudge > sound_stats.step_max) sound_stats.step_max = nudge;
+	}
+	drc.step = drc.base + (int)(((long long)drc.base * nudge) >> 16);
+	return drc.step == 1<<16 && (drc.pos & 0xffff) == 0 && pcm.stereo;
+}
+
+/* Frames of room for a block of n, counting any that will not fit */
+static int reserve(int n)
+{
+	int room = pcm.stereo ? pcm_space() >> 1 : pcm_space();
+	if (room >= n) return n;
+	pcm.overflows += n - room;
+	return room < 0 ? 0 : room;
+}
 
-		if (S3.on)
+/* Filters n staged frames down to the output rate into the ring */
+static void IRAM_ATTR decimate(int n)
+{
+	int i, k, l, r, room;
+	unsigned pos, w = pcm.head, mask = pcm.len - 1;
+	const short *c;
+	const int16_t *in;
+
+	room = pcm.stereo ? pcm_space() >> 1 : pcm_space();
+	for (pos = drc.pos; (i = pos >> 16) < n; pos += drc.step)
+	{
+		if (!room--)
 		{
-			s = WAVE[(S3.pos>>22) & 15];
-			if (S3.pos & (1<<21)) s &= 15;
-			else s >>= 4;
-			s -= 8;
-			S3.pos += S3.freq;
-			if ((R_NR34 & 64) && ((S3.cnt += RATE) >= S3.len))
-				S3.on = 0;
-			if (R_NR32 & 96) s <<= (3 - ((R_NR32>>5)&3));
-			else s = 0;
-			if (R_NR51 & 4) r += s;
-			if (R_NR51 & 64) l += s;
+			pcm.overflows += (n - i) * (1<<16) / drc.step;
+			pos = n << 16;
+			break;
 		}
+		c = rs_kernel[(pos >> (16 - RS_PHASE_BITS)) & (RS_PHASES-1)];
+		in = stage + 2 * (i - RS_TAPS + 1);
+		l = r = 0;
+		for (k = 0; k < RS_TAPS; k++)
+		{
+			l += in[2*k] * c[k];
+			r += in[2*k+1] * c[k];
+		}
+		l >>= RS_KERNEL_BITS;
+		r >>= RS_KERNEL_BITS;
+		if (l > 32767) l = 32767;
+		else if (l < -32768) l = -32768;
+		if (r > 32767) r = 32767;
+		else if (r < -32768) r = -32768;
+		if (pcm.stereo)
+		{
+			pcm.buf[w++ & mask] = l;
+			pcm.buf[w++ & mask] = r;
+		}
+		else pcm.buf[w++ & mask] = (l + r) >> 1;
+	}
+	drc.pos = pos - (n << 16);
+	memmove(staged, staged + 2 * n, 2 * RS_TAPS * sizeof *staged);
+	sound_stats.resampled += w - pcm.head;
+	pcm_commit(w - pcm.head);
+}
 
-		if (S4.on)
+/* Resamples n staged frames into the ring */
+static void IRAM_ATTR output(int n)
+{
+	int i, l, r, pl, pr, room, frac;
+	unsigned pos, w = pcm.head, mask = pcm.len - 1;
+
+	if (drc.base != 1<<16)
+	{
+		decimate(n);
+		return;
+	}
+	room = pcm.stereo ? pcm_space() >> 1 : pcm_space();
+	for (pos = drc.pos; (i = pos >> 16) < n; pos += drc.step)
+	{
+		if (!room--)
 		{
-			if (R_NR43 & 8) s = 1 & (noise7[
-				(S4.pos>>20)&15] >> (7-((S4.pos>>17)&7)));
-			else s = 1 & (noise15[
-				(S4.pos>>20)&4095] >> (7-((S4.pos>>17)&7)));
-			s = (-s) & S4.envol;
-			S4.pos += S4.freq;
-			if ((R_NR44 & 64) && ((S4.cnt += RATE) >= S4.len))
-				S4.on = 0;
-			if (S4.enlen && (S4.encnt += RATE) >= S4.enlen)
+			pcm.overflows += n - i;
+			pos = n << 16;
+			break;
+		}
+		pl = i ? stage[2*i-2] : drc.l;
+		pr = i ? stage[2*i-1] : drc.r;
+		frac = (pos & 0xffff) >> 1;
+		l = pl + (((stage[2*i] - pl) * frac) >> 15);
+		r = pr + (((stage[2*i+1] - pr) * frac) >> 15);
+		if (pcm.stereo)
+		{
+			pcm.buf[w++ & mask] = l;
+			pcm.buf[w++ & mask] = r;
+		}
+		else pcm.buf[w++ & mask] = (l + r) >> 1;
+	}
+	drc.pos = pos - (n << 16);
+	drc.l = stage[2*n-2];
+	drc.r = stage[2*n-1];
+	sound_stats.resampled += w - pcm.head;
+	pcm_commit(w - pcm.head);
+}
+
+/* Direct writes keep the resampler's one-frame delay: the held frame goes
+   out first and the block's last frame, written past the end of what is
+   committed, is held back for next time */
+static unsigned direct_begin()
+{
+	unsigned w = pcm.head, mask = pcm.len - 1;
+	pcm.buf[w++ & mask] = drc.l;
+	pcm.buf[w++ & mask] = drc.r;
+	return w;
+}
+
+static void direct_end(unsigned w)
+{
+	unsigned mask = pcm.len - 1;
+	drc.l = pcm.buf[(w - 2) & mask];
+	drc.r = pcm.buf[(w - 1) & mask];
+	sound_stats.direct += w - 2 - pcm.head;
+	pcm_commit(w - 2 - pcm.head);
+}
+
+/* Scales the accumulators by the NR50 levels, the master <<4 and the
+   output volume in one fixed-point gain per side, saturating to 16 bits */
+static unsigned IRAM_ATTR pack(int16_t *buf, unsigned w, unsigned mask, int n)
+{
+	int i, l, r;
+	int gl = (R_NR50 & 0x07) * pcm.volume;
+	int gr = ((R_NR50 & 0x70)>>4) * pcm.volume;
+
+	for (i = 0; i < n; i++)
+	{
+		l = (mixl[i] * gl) >> 4;
+		r = (mixr[i] * gr) >> 4;
+		if (l > 32767) l = 32767;
+		else if (l < -32768) l = -32768;
+		if (r > 32767) r = 32767;
+		else if (r < -32768) r = -32768;
+		buf[w++ & mask] = l;
+		buf[w++ & mask] = r;
+	}
+	return w;
+}
+
+/* Writes count samples of zeros at w, in two runs if the ring wraps */
+static unsigned zero(unsigned w, int count)
+{
+	int run = pcm.len - (w & (pcm.len - 1));
+
+	if (run > count) run = count;
+	memset(pcm.buf + (w & (pcm.len - 1)), 0, run * sizeof *pcm.buf);
+	memset(pcm.buf, 0, (count - run) * sizeof *pcm.buf);
+	return w + count;
+}
+
+/* A block nothing can be heard in: zeros go straight into the ring when
+   the rate control is locked, otherwise the resampler still has the
+   last frames of sound to settle from */
+static void IRAM_ATTR silence(int n)
+{
+	int m;
+
+	sound_stats.silent += n;
+	if (drc_update(n))
+	{
+		m = reserve(n + 1) - 1;
+		if (m > 0) direct_end(zero(direct_begin(), 2 * m));
+	}
+	else
+	{
+		memset(stage, 0, 2 * n * sizeof *stage);
+		output(n);
+	}
+}
+
+/* Renders the samples falling in spans that end at sequencer ticks, so
+   the length, envelope and sweep units only run 512 times a second */
+static void IRAM_ATTR sound_mix_step(int units)
+{
+	int span, n, m, h;
+
+	if (snd.seq <= 0) snd.seq = SEQ_PERIOD;
+	while (units > 0)
+	{
+		span = units < snd.seq ? units : snd.seq;
+		snd.frac += span * snd.hz;
+		n = snd.frac >> 21;
+		snd.frac &= (1<<21) - 1;
+
+		h = heard();
+		mix_block(n, h);
+		sound_stats.frames += n;
+		if (pcm.buf && n)
+		{
+			if (!h) silence(n);
+			else if (drc_update(n))
+			{
+				m = reserve(n + 1) - 1;
+				if (m > 0) direct_end(pack(pcm.buf, direct_begin(), pcm.len - 1, m));
+			}
+			else
 			{
-				S4.encnt -= S4.enlen;
-				S4.envol += S4.endir;
-				if (S4.envol < 0) S4.envol = 0;
-				if (S4.envol > 15) S4.envol = 15;
+				pack(stage, 0, ~0u, n);
+				output(n);
 			}
-			s += s << 1;
-			if (R_NR51 & 8) r += s;
-			if (R_NR51 & 128) l += s;
 		}
 
-		l *= (R_NR50 & 0x07);
-		r *= ((R_NR50 & 0x70)>>4);
-		// l >>= 4;
-		// r >>= 4;
+		units -= span;
+		if ((snd.seq -= span) == 0)
+		{
+			sound_sequencer();
+			snd.seq = SEQ_PERIOD;
+		}
+	}
+}
+
+/* Sends a channel's new output level to the blip buffer, panned and
+   scaled the same way the stepped mixer scales its samples */
+static void IRAM_ATTR blep_level(int ch, int t, int s)
+{
+	struct sndblep *b = &snd.blep[ch];
+	int l = (R_NR51 & (16<<ch)) ? (s * (R_NR50 & 0x07)) << 4 : 0;
+	int r = (R_NR51 & (1<<ch)) ? (s * ((R_NR50 & 0x70)>>4)) << 4 : 0;
+
+	if (l != b->l || r != b->r)
+	{
+		blip_add(t, l - b->l, r - b->r);
+		b->l = l;
+		b->r = r;
+	}
+}
+
+/* Counts off the waveform steps of a channel that cannot be heard in
+   one go, where the loops below would visit each edge */
+static void IRAM_ATTR blep_skip(struct sndblep *b, int t, int end, int period, int mask)
+{
+	int k;
+
+	sound_stats.idle += ((end - t) * snd.hz) >> 21;
+	t += b->delay;
+	if (t < end)
+	{
+		k = (end - t + period - 1) / period;
+		b->phase = (b->phase + k) & mask;
+		t += k * period;
+	}
+	b->delay = t - end;
+}
+
+static void IRAM_ATTR blep_square(int ch, int duty, int d, int t, int end)
+{
+	struct sndchan *c = &snd.ch[ch];
+	struct sndblep *b = &snd.blep[ch];
+	const byte *wave = sqwave[duty];
+
+	if (!c->on)
+	{
+		blep_level(ch, t, 0);
+		return;
+	}
+	/* tones above the output band hold still, as in the stepped mixer */
+	if (RATE > (d<<4))
+	{
+		blep_level(ch, t, (wave[b->phase] & c->envol) << 2);
+		return;
+	}
+	if (!c->envol || !audible(ch))
+	{
+		blep_level(ch, t, 0);
+		blep_skip(b, t, end, d << 1, 7);
+		return;
+	}
+	blep_level(ch, t, (wave[b->phase] & c->envol) << 2);
+	for (t += b->delay; t < end; t += d << 1)
+	{
+		b->phase = (b->phase + 1) & 7;
+		blep_level(ch, t, (wave[b->phase] & c->envol) << 2);
+	}
+	b->delay = t - end;
+}
 
-		l <<= 4;
-		r <<= 4;
+inline static int wave_sample(int phase, int shift)
+{
+	int s = WAVE[phase >> 1];
+	if (phase & 1) s &= 15;
+	else s >>= 4;
+	return (s - 8) << (3 - shift);
+}
 
-		// if (l > 127) l = 127;
-		// else if (l < -128) l = -128;
-		// if (r > 127) r = 127;
-		// else if (r < -128) r = -128;
+static void IRAM_ATTR blep_wave(int t, int end)
+{
+	struct sndblep *b = &snd.blep[2];
+	int d = 2048 - (((R_NR34&7)<<8) + R_NR33);
+	int shift = (R_NR32 >> 5) & 3;
 
-		if (pcm.buf)
+	if (!S3.on || !shift)
+	{
+		blep_level(2, t, 0);
+		return;
+	}
+	if (RATE > (d<<3))
+	{
+		blep_level(2, t, wave_sample(b->phase, shift));
+		return;
+	}
+	if (!audible(2))
+	{
+		blep_level(2, t, 0);
+		blep_skip(b, t, end, d, 31);
+		return;
+	}
+	blep_level(2, t, wave_sample(b->phase, shift));
+	for (t += b->delay; t < end; t += d)
+	{
+		b->phase = (b->phase + 1) & 31;
+		blep_level(2, t, wave_sample(b->phase, shift));
+	}
+	b->delay = t - end;
+}
+
+#define NOISE_BIT(bits, n) (1 & ((bits)[(n)>>3] >> (7-((n)&7))))
+
+static void IRAM_ATTR blep_noise(int t, int end)
+{
+	struct sndblep *b = &snd.blep[3];
+	int shift = R_NR43 >> 4, ratio = R_NR43 & 7;
+	int mask = (R_NR43 & 8) ? 127 : 32767;
+	const byte *bits = (R_NR43 & 8) ? noise7 : noise15;
+	int period = ratio ? ratio << (shift + 3) : 4 << shift;
+
+	if (!S4.on)
+	{
+		blep_level(3, t, 0);
+		return;
+	}
+	b->phase &= mask;
+	/* at most two noise bits per output sample, as in the stepped mixer */
+	if (period < RATE/2) period = RATE/2;
+	if (!S4.envol || !audible(3))
+	{
+		blep_level(3, t, 0);
+		blep_skip(b, t, end, period, mask);
+		return;
+	}
+	blep_level(3, t, 3 * (-NOISE_BIT(bits, b->phase) & S4.envol));
+	for (t += b->delay; t < end; t += period)
+	{
+		b->phase = (b->phase + 1) & mask;
+		blep_level(3, t, 3 * (-NOISE_BIT(bits, b->phase) & S4.envol));
+	}
+	b->delay = t - end;
+}
+
+/* Runs each channel from waveform edge to waveform edge, splitting the
+   span at sequencer ticks, then integrates the finished samples */
+static void IRAM_ATTR sound_mix_blep(int units)
+{
+	int span, t, end, n, m, room, run;
+	unsigned w;
+
+	while (units > 0)
+	{
+		span = units;
+		if (span > blip_span()) span = blip_span();
+		if (snd.seq <= 0) snd.seq = SEQ_PERIOD;
+		for (t = 0; t < span; t = end)
 		{
-			if (pcm.pos >= pcm.len)
+			end = t + snd.seq;
+			if (end > span) end = span;
+			blep_square(0, R_NR11>>6, 2048 - (((R_NR14&7)<<8) + R_NR13), t, end);
+			blep_square(1, R_NR21>>6, 2048 - (((R_NR24&7)<<8) + R_NR23), t, end);
+			blep_wave(t, end);
+			blep_noise(t, end);
+			if ((snd.seq -= end - t) == 0)
 			{
-				//pcm_submit();
-				printf("sound_mix: buffer overflow. (pcm.len=%d)\n", pcm.len);
-				//abort();
+				sound_sequencer();
+				snd.seq = SEQ_PERIOD;
 			}
-			else if (pcm.stereo)
+		}
+		units -= span;
+
+		n = blip_end(span);
+		sound_stats.frames += n;
+		for (; n > 0; n -= m)
+		{
+			m = n < MIX_BLOCK ? n : MIX_BLOCK;
+			if (!pcm.buf) blip_read(NULL, m, 1, pcm.volume);
+			else if (blip_quiet())
+			{
+				blip_read(NULL, m, 1, pcm.volume);
+				silence(m);
+			}
+			else if (drc_update(m))
 			{
-				pcm.buf[pcm.pos++] = (int16_t)l; //+128;
-				pcm.buf[pcm.pos++] = (int16_t)r; //+128;
+				/* integrate straight into the ring, in two runs if it wraps */
+				room = reserve(m + 1) - 1;
+				if (room > 0)
+				{
+					w = direct_begin();
+					run = (pcm.len - (w & (pcm.len - 1))) >> 1;
+					if (run > room) run = room;
+					blip_read(pcm.buf + (w & (pcm.len - 1)), run, 1, pcm.volume);
+					blip_read(pcm.buf, room - run, 1, pcm.volume);
+					direct_end(w + 2 * room);
+				}
+				blip_read(NULL, m - (room > 0 ? room : 0), 1, pcm.volume);
 			}
-			else pcm.buf[pcm.pos++] = (int16_t)((l+r)>>1); //+128;
+			else
+			{
+				blip_read(stage, m, 1, pcm.volume);
+				output(m);
+			}
+		}
+	}
+}
+
+/* Triggering the wave channel garbles the wave RAM the CPU sees; this
+   is done on the CPU side so the synth core leaves ram.hi alone */
+static void wave_trigger()
+{
+	int i;
+	for (i = 0; i < 16; i++)
+		ram.hi[i+0x30] = 0x13 ^ ram.hi[i+0x31];
+}
+
+static void IRAM_ATTR log_put(int r, int b)
+{
+	unsigned head = reglog.head;
+	int spins;
+
+	if (head - __atomic_load_n(&reglog.tail, __ATOMIC_ACQUIRE) >= LOG_SIZE)
+	{
+		sound_stats.log_stalls++;
+		if (sound_notify) sound_notify();
+		/* the synth side usually frees a record within a few polls; if
+		   it does not, it is not running, so give it the CPU */
+		for (spins = 0; head - __atomic_load_n(&reglog.tail, __ATOMIC_ACQUIRE) >= LOG_SIZE; spins++)
+			if (spins >= LOG_SPINS) sys_sleep(1000);
+	}
+	reglog.buf[head & (LOG_SIZE-1)] = (un32)cpu.snd << 14 | r << 8 | b;
+	__atomic_store_n(&reglog.head, head + 1, __ATOMIC_RELEASE);
+	sound_stats.logged++;
+	/* bursts of writes get the synth side going before vblank does */
+	if (!((head + 1) & (LOG_SIZE/4 - 1)) && sound_notify) sound_notify();
+}
+
+/* Closes the span at the current time, stamps start again from zero */
+static void IRAM_ATTR log_span()
+{
+	log_put(0, 0);
+	shadow.clock += cpu.snd;
+	cpu.snd = 0;
+}
+
+static const byte lenreg[4] = { RI_NR11, RI_NR21, RI_NR31, RI_NR41 };
+
+/* NR52 as the mixer would report it: channels stop when their length
+   runs out, give or take a sequencer tick; the sweep is not modelled */
+static byte shadow_status()
+{
+	unsigned now = shadow.clock + cpu.snd;
+	int i, len;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (!(shadow.on & (1<<i)) || !(ram.hi[lenreg[i]+3] & 64)) continue;
+		if (i == 2) len = 256 - ram.hi[RI_NR31];
+		else len = 64 - (ram.hi[lenreg[i]] & 63);
+		if (now - shadow.start[i] >= (unsigned)len << 13)
+			shadow.on &= ~(1<<i);
+	}
+	return (ram.hi[RI_NR52] & 0xf0) | shadow.on;
+}
+
+/* The CPU side of a deferred write: ram.hi and the shadow take it now,
+   the mixer when the synth side reaches its timestamp */
+static void IRAM_ATTR shadow_write(byte r, byte b)
+{
+	int i;
+
+	if (!(ram.hi[RI_NR52] & 128) && r != RI_NR52) return;
+	if ((r & 0xF0) == 0x30)
+	{
+		if (!(shadow_status() & 4)) ram.hi[r] = b;
+		log_put(r, b);
+		return;
+	}
+	if (r == 0x15 || r == 0x1F || r > RI_NR52) return;
+	ram.hi[r] = b;
+	switch (r)
+	{
+	case RI_NR14:
+	case RI_NR24:
+	case RI_NR34:
+	case RI_NR44:
+		if (!(b & 128)) break;
+		i = (r - RI_NR14) / 5;
+		if (i == 2 && !(ram.hi[RI_NR30] & 128))
+		{
+			shadow.on &= ~4;
+			break;
+		}
+		shadow.on |= 1 << i;
+		shadow.start[i] = shadow.clock + cpu.snd;
+		if (i == 2) wave_trigger();
+		break;
+	case RI_NR30:
+		if (!(b & 128)) shadow.on &= ~4;
+		break;
+	case RI_NR52:
+		if (!(b & 128))
+		{
+			regs_off(ram.hi);
+			shadow.on = 0;
 		}
+		break;
 	}
+	log_put(r, b);
+}
+
+/* Renders the next units of sound with whichever engine is selected */
+static void IRAM_ATTR render(int units)
+{
+	unsigned start = xthal_get_ccount();
+
+	if (sound_engine == SOUND_BLEP) sound_mix_blep(units);
+	else sound_mix_step(units);
+	sound_stats.cycles[sound_rate][sound_engine] += xthal_get_ccount() - start;
+	sound_stats.units[sound_rate][sound_engine] += units;
+
 	R_NR52 = (R_NR52&0xf0) | S1.on | (S2.on<<1) | (S3.on<<2) | (S4.on<<3);
 }
 
+void IRAM_ATTR sound_mix()
+{
+	if (!RATE) return;
+	if (sound_deferred)
+	{
+		if (cpu.snd) log_span();
+		if (sound_notify) sound_notify();
+		return;
+	}
+	if (cpu.snd < RATE) return;
+
+	render(cpu.snd);
+	cpu.snd = 0;
+	mirror();
+}
+
 
 
 byte sound_read(byte r)
 {
+	if (sound_deferred)
+		return r == RI_NR52 ? shadow_status() : ram.hi[r];
 	sound_mix();
-	/* printf("read %02X: %02X\n", r, REG(r)); */
-	return REG(r);
+	/* printf("read %02X: %02X\n", r, ram.hi[r]); */
+	return ram.hi[r];
 }
 
 void s1_init()
@@ -310,7 +1167,7 @@ void s1_init()
 	S1.endir = (R_NR12>>3) & 1;
 	S1.endir |= S1.endir - 1;
 	S1.enlen = (R_NR12 & 7) << 15;
-	if (!S1.on) S1.pos = 0;
+	if (!S1.on) S1.pos = snd.blep[0].phase = snd.blep[0].delay = 0;
 	S1.on = 1;
 	S1.cnt = 0;
 	S1.encnt = 0;
@@ -322,7 +1179,7 @@ void s2_init()
 	S2.endir = (R_NR22>>3) & 1;
 	S2.endir |= S2.endir - 1;
 	S2.enlen = (R_NR22 & 7) << 15;
-	if (!S2.on) S2.pos = 0;
+	if (!S2.on) S2.pos = snd.blep[1].phase = snd.blep[1].delay = 0;
 	S2.on = 1;
 	S2.cnt = 0;
 	S2.encnt = 0;
@@ -330,12 +1187,9 @@ void s2_init()
 
 void s3_init()
 {
-	int i;
-	if (!S3.on) S3.pos = 0;
+	if (!S3.on) S3.pos = snd.blep[2].phase = snd.blep[2].delay = 0;
 	S3.cnt = 0;
 	S3.on = R_NR30 >> 7;
-	if (S3.on) for (i = 0; i < 16; i++)
-		ram.hi[i+0x30] = 0x13 ^ ram.hi[i+0x31];
 }
 
 void s4_init()
@@ -345,29 +1199,22 @@ void s4_init()
 	S4.endir |= S4.endir - 1;
 	S4.enlen = (R_NR42 & 7) << 15;
 	S4.on = 1;
-	S4.pos = 0;
+	S4.pos = snd.blep[3].phase = snd.blep[3].delay = 0;
 	S4.cnt = 0;
 	S4.encnt = 0;
 }
 
 
-void IRAM_ATTR sound_write(byte r, byte b)
+/* Applies a register write to the mixer's state, at the current point
+   of synthesis */
+static void IRAM_ATTR reg_write(byte r, byte b)
 {
-#if 0
-	static void *timer;
-	if (!timer) timer = sys_timer();
-	printf("write %02X: %02X @ %d\n", r, b, sys_elapsed(timer));
-#endif
-
 	if (!(R_NR52 & 128) && r != RI_NR52) return;
 	if ((r & 0xF0) == 0x30)
 	{
-		if (S3.on) sound_mix();
-		if (!S3.on)
-			WAVE[r-0x30] = ram.hi[r] = b;
+		if (!S3.on) WAVE[r-0x30] = b;
 		return;
 	}
-	sound_mix();
 	switch (r)
 	{
 	case RI_NR10:
@@ -469,3 +1316,61 @@ void IRAM_ATTR sound_write(byte r, byte b)
 		return;
 	}
 }
+
+void IRAM_ATTR sound_write(byte r, byte b)
+{
+#if 0
+	static void *timer;
+	if (!timer) timer = sys_timer();
+	printf("write %02X: %02X @ %d\n", r, b, sys_elapsed(timer));
+#endif
+
+	if (sound_deferred)
+	{
+		if (cpu.snd >= LOG_SPAN) log_span();
+		shadow_write(r, b);
+		return;
+	}
+	if (!(R_NR52 & 128) && r != RI_NR52) return;
+	if ((r & 0xF0) == 0x30)
+	{
+		if (S3.on) sound_mix();
+		if (!S3.on)
+			WAVE[r-0x30] = ram.hi[r] = b;
+		return;
+	}
+	sound_mix();
+	reg_write(r, b);
+	if (r == RI_NR34 && (b & 128) && S3.on) wave_trigger();
+	mirror();
+}
+
+/* Renders everything logged so far, on the core the host runs it on;
+   only this side touches snd and the ring while deferred */
+void IRAM_ATTR sound_synth()
+{
+	unsigned head = __atomic_load_n(&reglog.head, __ATOMIC_ACQUIRE);
+	un32 rec;
+	int t;
+
+	while (reglog.tail != head)
+	{
+		rec = reglog.buf[reglog.tail & (LOG_SIZE-1)];
+		t = rec >> 14;
+		if (t > reglog.now)
+		{
+			render(t - reglog.now);
+			reglog.now = t;
+		}
+		if (rec & 0x3f00) reg_write((rec >> 8) & 0x3f, rec & 0xff);
+		else reglog.now = 0;
+		__atomic_store_n(&reglog.tail, reglog.tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* True once the synth side has caught up with every logged write, the
+   host waits for this before saving, loading or resetting */
+int sound_idle()
+{
+	return __atomic_load_n(&reglog.tail, __ATOMIC_ACQUIRE) == reglog.head;
+}
@@ -14,20 +14,68 @@ struct sndchan
 };
 
 
+/* Per-channel state of the band-limited engine */
+struct sndblep
+{
+	int delay; /* 2MHz units until the next waveform step */
+	int phase;
+	int l, r; /* amplitude last sent to the blip buffer */
+};
+
+
 struct snd
 {
-	int rate;
+	int rate, hz;
+	unsigned frac; /* position between output samples, 1<<21 per sample */
 	struct sndchan ch[4];
 	byte wave[16];
+	int seq; /* 2MHz units until the next frame sequencer tick */
+	struct sndblep blep[4];
+	byte reg[0x30]; /* the mixer's copy of NR10-NR52, indexed as ram.hi */
+};
+
+#define SOUND_STEP 0 /* steps every channel once per output sample */
+#define SOUND_BLEP 1 /* band-limited deltas at waveform edges */
+#define SOUND_ENGINES 2
+
+#define SOUND_RATES 6 /* output rates on offer, see sound_rates */
+
+struct sound_stats
+{
+	/* mixer time and 2MHz units of sound it covered, per output rate */
+	unsigned long long cycles[SOUND_RATES][SOUND_ENGINES];
+	unsigned long long units[SOUND_RATES][SOUND_ENGINES];
+	/* rate control: samples buffered, in the ring and past it, seen at each output block, nudge range */
+	unsigned long long fill, fill_error;
+	unsigned fill_count;
+	int step_min, step_max;
+	unsigned long long direct, resampled; /* samples written each way */
+	/* frames mixed, those that were silence throughout, and channel
+	   frames skipped while a channel was on but could not be heard */
+	unsigned long long frames, silent, idle;
+	unsigned long long logged; /* register writes deferred to sound_synth() */
+	unsigned log_stalls; /* times the CPU side waited on a full log */
 };
 
 
 extern struct snd snd;
+extern struct sound_stats sound_stats;
+extern int sound_engine;
+extern int sound_rate;
+extern const int sound_rates[SOUND_RATES];
+extern int sound_deferred; /* synthesise from a write log, see sound_synth() */
+extern void (*sound_notify)(); /* host hook, wakes whoever runs sound_synth() */
 
 void sound_write(byte r, byte b);
 byte sound_read(byte r);
 void sound_dirty();
 void sound_reset();
 void sound_mix();
+void sound_engine_set(int engine);
+const char *sound_engine_name(int engine);
+void sound_rate_set(int rate);
+int sound_mix_hz(int rate, int engine);
+void sound_synth();
+int sound_idle();
 
 #endif
@@ -1,17 +1,24 @@
 #include "audio.h"
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "driver/i2s.h"
 #include "driver/rtc_io.h"
 #include "driver/gpio.h"
 #include "hal/gpio_hal.h"
+#include <pcm.h>
 
 static bool active = false;
+static int sampleRate = 0;
+static int dmaFrames = AUDIO_DMA_FRAMES;
+static bool resized = false; // dmaFrames changed while stopped, the driver is reinstalled on resume
+// Held around every driver call: the audio task resizes and writes, the emulator task stops and resumes
+static SemaphoreHandle_t lock = NULL;
 
-static float Volume = 1.0f;
 static volume_level volumeLevel = VOLUME_LEVEL1;
-static int volumeLevels[] = {0, 125, 250, 500, 1000};
+// Output gain applied by the mixer, 256 is unity
+static int volumeLevels[] = {0, 32, 64, 128, 256};
 
 volume_level audio_volume_get() {
     return volumeLevel;
@@ -24,7 +31,7 @@ void audio_volume_set(volume_level value) {
     }
 
     volumeLevel = value;
-    Volume = (float)volumeLevels[value] * 0.001f;
+    pcm.volume = volumeLevels[value];
 }
 
 int audio_volume_change() {
@@ -48,19 +55,17 @@ int audio_volume_decrease() {
     return level;
 }
 
-void audio_init(int sample_rate) {
-    printf("%s: sample_rate=%d\n", __func__, sample_rate);
-
+static void audio_install() {
     // NOTE: buffer needs to be adjusted per AUDIO_SAMPLE_RATE
     i2s_config_t i2s_config = {
         .mode = I2S_MODE_MASTER | I2S_MODE_TX,                                  // Only TX
-        .sample_rate = sample_rate,
+        .sample_rate = sampleRate,
         .bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT,
         .channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT,                           //2-channels
         .communication_format = I2S_COMM_FORMAT_STAND_I2S,
-        .dma_buf_count = 6,
+        .dma_buf_count = AUDIO_DMA_BUFFERS,
         //.dma_buf_len = 1472 / 2,  // (368samples * 2ch * 2(short)) = 1472
-        .dma_buf_len = 512,  // (416samples * 2ch * 2(short)) = 1664
+        .dma_buf_len = dmaFrames,  // (416samples * 2ch * 2(short)) = 1664
         .intr_alloc_flags = 0,//ESP_INTR_FLAG_LEVEL1,                                //Interrupt level 1
         .use_apll = true
     };
@@ -74,27 +79,53 @@ void audio_init(int sample_rate) {
             .data_in_num  = I2S_PIN_NO_CHANGE
         };
     i2s_set_pin(I2S_NUM, &pin_config);
-    
+}
+
+void audio_init(int sample_rate, int dma_frames) {
+    printf("%s: sample_rate=%d dma_frames=%d\n", __func__, sample_rate, dma_frames);
+    sampleRate = sample_rate;
+    dmaFrames = dma_frames;
+    lock = xSemaphoreCreateMutex();
+    audio_install();
+
     PIN_FUNC_SELECT(PERIPHS_IO_MUX_GPIO0_U, FUNC_GPIO0_CLK_OUT1);
     WRITE_PERI_REG(PIN_CTRL, 0xFFF0);
     active = true;
 }
 
-void audio_submit(short* stereoAudioBuffer, int frameCount) {
-    if (!active) return;
-    short currentAudioSampleCount = frameCount*2;
-    for (short i = 0; i < currentAudioSampleCount; ++i) {
-        int sample = stereoAudioBuffer[i] * Volume;
-        if (sample > 32767)
-            sample = 32767;
-        else if (sample < -32767)
-            sample = -32767;
-
-        stereoAudioBuffer[i] = ((short)sample);// * 0.5;
+void audio_sample_rate_set(int sample_rate) {
+    printf("%s: sample_rate=%d\n", __func__, sample_rate);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    sampleRate = sample_rate;
+    i2s_set_sample_rates(I2S_NUM, sample_rate);
+    xSemaphoreGive(lock);
+}
+
+// The driver only sizes its DMA buffers when installed, so changing them drops what is queued
+void audio_dma_frames_set(int dma_frames) {
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (dma_frames != dmaFrames) {
+        dmaFrames = dma_frames;
+        if (active) {
+            i2s_driver_uninstall(I2S_NUM);
+            audio_install();
+        } else {
+            // A fresh install starts the output, so leave it to audio_resume()
+            resized = true;
+        }
     }
-    int len = currentAudioSampleCount * sizeof(int16_t);    
-    size_t count;
-    i2s_write(I2S_NUM, (const char *)stereoAudioBuffer, len, &count, portMAX_DELAY);
+    xSemaphoreGive(lock);
+}
+
+// i2s_write() copies the samples into the driver's DMA buffers, so the caller's buffer is free again on return
+void audio_submit(short* stereoAudioBuffer, int frameCount) {
+    // Samples arrive with the volume already applied by the mixer
+    int len = frameCount * 2 * sizeof(int16_t);
+    size_t count = len;
+    // Held while the write waits for a DMA buffer, so the output is not stopped under it
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (active) i2s_write(I2S_NUM, (const char *)stereoAudioBuffer, len, &count, portMAX_DELAY);
+    xSemaphoreGive(lock);
     if (count != len) {
         printf("i2s_write_bytes: count (%d) != len (%d)\n", count, len);
         abort();
@@ -102,14 +133,30 @@ void audio_submit(short* stereoAudioBuffer, int frameCount) {
 }
 
 void audio_stop() {
-    if (!active) return;
-    i2s_zero_dma_buffer(I2S_NUM);
-    i2s_stop(I2S_NUM);
-    active = false;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (active) {
+        i2s_zero_dma_buffer(I2S_NUM);
+        i2s_stop(I2S_NUM);
+        active = false;
+    }
+    xSemaphoreGive(lock);
 }
 
 void audio_resume() {
-    if (active) return;
-    i2s_start(I2S_NUM);
-    active = true;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (!active) {
+        if (resized) {
+            i2s_driver_uninstall(I2S_NUM);
+            audio_install();
+            resized = false;
+        } else {
+            i2s_start(I2S_NUM);
+        }
+        active = true;
+    }
+    xSemaphoreGive(lock);
+}
+
+bool audio_is_active() {
+    return active;
 }
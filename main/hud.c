@@ -0,0 +1,38 @@
+#include "hud.h"
+
+// 3x5 glyphs for ' ' to 'Z', five rows of three bits with the top left pixel in bit 14
+static const uint16_t font[] = {
+    0x0000, 0x2482, 0x5a00, 0x5f7d, 0x3c9e, 0x52a5, 0x2aab, 0x2400, //  !"#$%&'
+    0x1491, 0x4494, 0x0aa8, 0x05d0, 0x0014, 0x01c0, 0x0002, 0x12a4, // ()*+,-./
+    0x7b6f, 0x2c97, 0x73e7, 0x72cf, 0x5bc9, 0x79cf, 0x79ef, 0x7292, // 01234567
+    0x7bef, 0x7bcf, 0x0410, 0x0414, 0x1511, 0x0e38, 0x4454, 0x72c2, // 89:;<=>?
+    0x2be3, 0x2bed, 0x6bae, 0x3923, 0x6b6e, 0x79a7, 0x79a4, 0x396b, // @ABCDEFG
+    0x5bed, 0x7497, 0x126a, 0x5bad, 0x4927, 0x5fed, 0x6b6d, 0x2b6a, // HIJKLMNO
+    0x6ba4, 0x2b73, 0x6bad, 0x388e, 0x7492, 0x5b6f, 0x5b6a, 0x5bfd, // PQRSTUVW
+    0x5aad, 0x5a92, 0x72a7,                                         // XYZ
+};
+
+void hud_fill(uint16_t* buffer, int width, int height, uint16_t colour) {
+    for (int i = 0; i < width * height; i++) {
+        buffer[i] = colour;
+    }
+}
+
+// Draws text into a width x height pixel buffer, colours are stored as given. Returns the x after the text.
+int hud_text(uint16_t* buffer, int width, int height, int x, int y, const char* text, uint16_t colour) {
+    for (; *text && x + 3 <= width; text++, x += HUD_CHAR_WIDTH) {
+        char c = *text;
+        if (c >= 'a' && c <= 'z') c -= 'a' - 'A';
+        if (c < ' ' || c > 'Z') c = '?';
+        uint16_t glyph = font[c - ' '];
+        for (int row = 0; row < 5; row++) {
+            if (y + row < 0 || y + row >= height) continue;
+            uint16_t* dst = buffer + (y + row) * width + x;
+            int bits = glyph >> (12 - row * 3);
+            if (bits & 4) dst[0] = colour;
+            if (bits & 2) dst[1] = colour;
+            if (bits & 1) dst[2] = colour;
+        }
+    }
+    return x;
+}
@@ -1,8 +1,12 @@
 #ifndef AUDIO_H
 #define AUDIO_H
 
+#include <stdbool.h>
+
 #define I2S_NUM     I2S_NUM_0
 #define VOLUME_LEVEL_COUNT (5)
+#define AUDIO_DMA_BUFFERS (6)
+#define AUDIO_DMA_FRAMES (512) // buffer length, the longest low-latency mode will grow to
 
 typedef enum
 {
@@ -16,10 +20,13 @@ typedef enum
 } volume_level;
 
 
-void audio_init(int sample_rate);
+void audio_init(int sample_rate, int dma_frames);
+void audio_sample_rate_set(int sample_rate);
+void audio_dma_frames_set(int dma_frames);
 void audio_submit(short* stereoAudioBuffer, int frameCount);
 void audio_stop();
 void audio_resume();
+bool audio_is_active();
 volume_level audio_volume_get();
 void audio_volume_set(volume_level value);
 int audio_volume_change();
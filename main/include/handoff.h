@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/*
+ * Triple buffered hand-off: the producer owns the buffer it draws into,
+ * the consumer owns the buffer it is reading and the third one sits in
+ * the hand-off slot. Both sides swap their buffer with the slot
+ * atomically, so neither ever waits for the other. HANDOFF_FRESH marks a
+ * completed buffer nobody has taken yet; replacing it drops that buffer.
+ */
+#define HANDOFF_FRESH (0x80)
+
+// Publishes the finished buffer and returns the one to draw into next, sets dropped if an untaken buffer was replaced
+static inline unsigned int handoff_publish(atomic_uint* slot, unsigned int done, bool* dropped) {
+    unsigned int previous = atomic_exchange(slot, done | HANDOFF_FRESH);
+    *dropped = (previous & HANDOFF_FRESH) != 0;
+    return previous & ~HANDOFF_FRESH;
+}
+
+// Swaps the owned buffer for the latest published one, if there is one that was not taken yet
+static inline bool handoff_take(atomic_uint* slot, unsigned int* owned) {
+    if (!(atomic_load(slot) & HANDOFF_FRESH)) return false;
+    *owned = atomic_exchange(slot, *owned) & ~HANDOFF_FRESH;
+    return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+
+// Cells of the built-in 3x5 font, one pixel of spacing on the right and below
+#define HUD_CHAR_WIDTH  (4)
+#define HUD_LINE_HEIGHT (6)
+
+void hud_fill(uint16_t* buffer, int width, int height, uint16_t colour);
+int hud_text(uint16_t* buffer, int width, int height, int x, int y, const char* text, uint16_t colour);
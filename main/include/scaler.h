@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#define SCALER_MAX_WIDTH  (320)
+#define SCALER_MAX_HEIGHT (240)
+
+// Bits of sub-pixel weight kept per column and row, 32 steps between two source pixels
+#define SCALER_WEIGHT_BITS (5)
+#define SCALER_WEIGHT_ONE  (1 << SCALER_WEIGHT_BITS)
+
+// Mean of two RGB565 pixels without unpacking them
+#define AVERAGE(a, b) ( ((((a) ^ (b)) & 0xf7deU) >> 1) + ((a) & (b)) )
+
+typedef enum
+{
+    SCALER_NEAREST = 0,
+    SCALER_BILINEAR = 1,
+    SCALER_AVERAGE = 2,
+
+    SCALER_MODE_COUNT
+} scaler_mode_t;
+
+// Source positions for every output column and row, computed once per geometry
+typedef struct _scaler_plan {
+    scaler_mode_t mode;
+    int src_width;
+    int src_height;
+    int dst_width;
+    int dst_height;
+    uint8_t col[SCALER_MAX_WIDTH];
+    uint8_t col_weight[SCALER_MAX_WIDTH];
+    uint8_t row[SCALER_MAX_HEIGHT];
+    uint8_t row_weight[SCALER_MAX_HEIGHT];
+} scaler_plan_t;
+
+const char* scaler_mode_name(scaler_mode_t mode);
+void scaler_plan(scaler_plan_t* plan, scaler_mode_t mode, int src_width, int src_height, int dst_width, int dst_height);
+void scaler_row(const scaler_plan_t* plan, const uint16_t* top, const uint16_t* bottom, int y, uint16_t* out);
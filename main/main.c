@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
 #include <sdkconfig.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -15,6 +16,7 @@
 #include <esp_spi_flash.h>
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <soc/rtc.h>
 #include <soc/rtc_cntl_reg.h>
 #include <hardware.h>
@@ -36,16 +38,45 @@
 #include "ws2812.h"
 #include "menu.h"
 #include "graphics_wrapper.h"
+#include "scaler.h"
+#include "hud.h"
+#include "handoff.h"
 
 #define SD_BASE_PATH "/sd"
 #define GAMEBOY_WIDTH (160)
 #define GAMEBOY_HEIGHT (144)
-#define AUDIO_SAMPLE_RATE (32000)
+#define AUDIO_SAMPLE_RATE (32000) // until the saved choice from sound_rates is read
+
+// Indexed framebuffers hold 8-bit colour indices plus the palettes used by the frame
+#define FRAMEBUFFER_INDEXED (0)
+#define FRAMEBUFFER_SIZE_RGB565 (GAMEBOY_WIDTH * GAMEBOY_HEIGHT * 2)
+#define FRAMEBUFFER_SIZE_INDEXED (GAMEBOY_WIDTH * GAMEBOY_HEIGHT + sizeof(struct fbpal))
+#define FRAMEBUFFER_SIZE (FRAMEBUFFER_INDEXED ? FRAMEBUFFER_SIZE_INDEXED : FRAMEBUFFER_SIZE_RGB565)
+// A display buffer holds the blend frame right after the presented one when blending
+#define DISPLAY_BUFFER_SIZE (FRAMEBUFFER_SIZE * (DISPLAY_BLEND ? 2 : 1))
+
+// Racing-the-beam: stream bands of finished lines to the panel instead of whole frames
+#define DISPLAY_BEAM (0)
+#define BEAM_LINES   (8)
+#define BEAM_BANDS   (4)
+
+// Draw the frames the display skips too and present the average of each pair, keeps 60 Hz flicker effects visible
+#define DISPLAY_BLEND (0)
+
+// Where the 64 KiB CGB colour correction table lives, without one colours are corrected from small factored tables
+#define COLOUR_TABLE_NONE   (0)
+#define COLOUR_TABLE_DRAM   (1)
+#define COLOUR_TABLE_PSRAM  (2)
+#define COLOUR_TABLE        (COLOUR_TABLE_NONE)
+
+// Time the colour conversion of every profile with every table placement at boot
+#define COLOUR_BENCH (0)
+
+// Filter used to scale the 160x144 frame up to the output window
+#define DISPLAY_SCALER (SCALER_BILINEAR)
 
-#define AVERAGE(a, b) ( ((((a) ^ (b)) & 0xf7deU) >> 1) + ((a) & (b)) )
 #define LINE_BUFFERS (4)
 #define LINE_COUNT   (19)
-#define LINE_COUNT_UNSCALED   (4)
 
 static const char *TAG = "main";
 
@@ -90,24 +121,69 @@ static nvs_handle_t nvs_handle_gnuboy;
 
 char rom_filename[512] = {0};
 
-uint16_t* displayBuffer[2]; //= { fb0, fb0 }; //[160 * 144];
+uint8_t* displayBuffer[FB_COUNT];
 uint8_t currentBuffer = 0;
 
-int16_t* audioBuffer[2];
-volatile uint8_t currentAudioBuffer = 0;
-volatile uint16_t currentAudioSampleCount;
-volatile int16_t* currentAudioBufferPtr;
+// Frames reach the display task through a triple buffer, see handoff.h: the emulator owns currentBuffer
+static atomic_uint displayLatest = 1;
+static uint32_t framesDropped = 0;
+static TaskHandle_t videoTaskHandle = NULL;
+
+// Changed lines of the last DIRTY_HISTORY published frames, by sequence number
+#define DIRTY_HISTORY (8)
+static uint32_t dirtyHistory[DIRTY_HISTORY][LCD_DIRTY_WORDS];
+static uint32_t displaySeq[FB_COUNT];
+static atomic_uint publishedSeq = 0;
+
+// Audio reaches the audio task through the pcm ring, a DMA buffer at a time
+#define AUDIO_RING_SIZE      (8192) // samples, a power of two
+#define AUDIO_CHUNK          (audioFrames * 2)
+#define AUDIO_HIGH_WATERMARK (AUDIO_CHUNK * 2)
+#define AUDIO_TARGET         (AUDIO_DMA_BUFFERS * AUDIO_CHUNK + AUDIO_CHUNK / 2) // the DMA buffers full and half a chunk in the ring
+#define AUDIO_DMA_US         ((int64_t) AUDIO_DMA_BUFFERS * audioFrames * 1000000 / pcm.hz)
+
+// Low-latency mode starts with short DMA buffers, doubles them after a second with an underrun and
+// trims them again after a quiet spell, waiting twice as long each time trimming led to an underrun
+#define AUDIO_LOW_LATENCY    (0)
+#define AUDIO_DMA_MIN_FRAMES (64)
+#define AUDIO_ADAPT_US       (1000000)
+#define AUDIO_PATIENCE       (10)  // quiet periods before the first trim
+#define AUDIO_PATIENCE_MAX   (600)
+static volatile int audioFrames = AUDIO_DMA_FRAMES; // DMA buffer length in use, the ring levels follow it
+static unsigned audioResizes = 0;
+
+// Ring positions stamped at the end of the emulated frame that filled them, timed again at the DAC
+#define AUDIO_STAMPS (8)
+static struct {
+    unsigned head;
+    int64_t time;
+} audioStamps[AUDIO_STAMPS];
+static atomic_uint stampHead = 0;
+static atomic_uint stampTail = 0;
+static int64_t latencyTotal = 0;
+static int64_t latencyMin = INT64_MAX;
+static int64_t latencyMax = 0;
+static unsigned latencyCount = 0;
+static volatile int64_t frameEnd = 0; // when the emulator last reached vblank, for the synth task's stamps
+static TaskHandle_t audioTaskHandle = NULL;
+
+// Sound register writes are logged with their timestamps and synthesised on the second core
+#define AUDIO_DEFERRED (0)
+static TaskHandle_t synthTaskHandle = NULL;
+static TaskHandle_t emulatorTaskHandle = NULL;
 
 int frame = 0;
 uint elapsedTime = 0;
 
 QueueHandle_t vidQueue;
-QueueHandle_t audioQueue;
+QueueHandle_t beamFreeQueue;
+QueueHandle_t spiQueue;      // Filled line buffers waiting for the bus
+QueueHandle_t lineFreeQueue; // Line buffers the bus is done with
 
 ILI9341* ili9341 = NULL;
 static pax_buf_t pax_buffer;
 xQueueHandle button_queue;
-uint16_t* framebuffer = NULL;
+uint8_t* framebuffer = NULL;
 
 uint16_t* line[LINE_BUFFERS];
 
@@ -117,10 +193,6 @@ uint8_t* rom_data = NULL;
 
 pax_buf_t border;
 
-// Note: Magic number obtained by adjusting until audio buffer overflows stop.
-const int audioBufferLength = AUDIO_SAMPLE_RATE / 10 + 1;
-const int AUDIO_BUFFER_SIZE = audioBufferLength * sizeof(int16_t) * 2;
-
 esp_err_t nvs_get_str_fixed(nvs_handle_t handle, const char* key, char* target, size_t target_size, size_t* size) {
     esp_err_t    res;
 
@@ -160,7 +232,76 @@ bool wait_for_button() {
     }
 }
 
+typedef struct _spi_transfer {
+    uint16_t* buffer;
+    int x;
+    int y;
+    int width;
+    int height;
+    int64_t stamp; // When the source lines were finished, 0 if the latency is not measured
+} spi_transfer_t;
+
+// Time the bus spent sending line buffers and time the renderer spent waiting for a free one
+static int64_t spi_busy_time = 0;
+static int64_t spi_wait_time = 0;
+
+// Time from a band leaving the LCD to the end of the last transfer made from it
+static int64_t beam_latency_total = 0;
+static int64_t beam_latency_max = 0;
+static uint32_t beam_latency_count = 0;
+
+static uint16_t* display_line_acquire() {
+    uint16_t* buffer;
+    if (xQueueReceive(lineFreeQueue, &buffer, 0) != pdTRUE) {
+        int64_t start = esp_timer_get_time();
+        xQueueReceive(lineFreeQueue, &buffer, portMAX_DELAY);
+        spi_wait_time += esp_timer_get_time() - start;
+    }
+    return buffer;
+}
+
+static void display_line_submit_stamped(uint16_t* buffer, int x, int y, int width, int height, int64_t stamp) {
+    spi_transfer_t transfer = {buffer, x, y, width, height, stamp};
+    xQueueSend(spiQueue, &transfer, portMAX_DELAY);
+}
+
+static void display_line_submit(uint16_t* buffer, int x, int y, int width, int height) {
+    display_line_submit_stamped(buffer, x, y, width, height, 0);
+}
+
+// Waits until every queued line buffer is on the panel
+void display_sync() {
+    if (lineFreeQueue == NULL) return;
+    uint16_t* buffers[LINE_BUFFERS];
+    for (int i = 0; i < LINE_BUFFERS; i++) {
+        xQueueReceive(lineFreeQueue, &buffers[i], portMAX_DELAY);
+    }
+    for (int i = 0; i < LINE_BUFFERS; i++) {
+        xQueueSend(lineFreeQueue, &buffers[i], 0);
+    }
+}
+
+// Owns the bus while the game runs, so the next bands are scaled while this one is sent
+void spiTask(void *arg) {
+    spi_transfer_t transfer;
+    while (1) {
+        xQueueReceive(spiQueue, &transfer, portMAX_DELAY);
+        int64_t start = esp_timer_get_time();
+        ili9341_write_partial_direct(ili9341, (uint8_t*) transfer.buffer, transfer.x, transfer.y, transfer.width, transfer.height);
+        int64_t end = esp_timer_get_time();
+        spi_busy_time += end - start;
+        if (transfer.stamp) {
+            int64_t latency = end - transfer.stamp;
+            beam_latency_total += latency;
+            if (latency > beam_latency_max) beam_latency_max = latency;
+            beam_latency_count++;
+        }
+        xQueueSend(lineFreeQueue, &transfer.buffer, portMAX_DELAY);
+    }
+}
+
 void disp_flush() {
+    display_sync();
     ili9341_write(get_ili9341(), pax_buffer.buf);
 }
 
@@ -205,113 +346,382 @@ void show_message(const char* message, uint16_t delay) {
     vTaskDelay(pdMS_TO_TICKS(delay));
 }
 
-static uint16_t getPixel(const uint16_t * bufs, int x, int y, int w1, int h1, int w2, int h2)
-{
-    int x_diff, y_diff, xv, yv, red , green, blue, col, a, b, c, d, index;
-    int x_ratio = (int) (((w1-1)<<16)/w2) + 1;
-    int y_ratio = (int) (((h1-1)<<16)/h2) + 1;
+static int colour_profile = LCD_CC_GBC;
+static uint16_t* colour_table = NULL;
+
+// Switches the CGB colour correction profile and reports what a palette write costs with it
+void colour_profile_set(int profile) {
+    if (profile < 0 || profile >= LCD_CC_COUNT) profile = LCD_CC_GBC;
+    colour_profile = profile;
+
+    if (COLOUR_TABLE != COLOUR_TABLE_NONE && colour_table == NULL) {
+        uint32_t caps = (COLOUR_TABLE == COLOUR_TABLE_PSRAM) ? MALLOC_CAP_SPIRAM : (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        colour_table = heap_caps_malloc(32768 * sizeof(uint16_t), caps);
+        if (colour_table == NULL) ESP_LOGW(TAG, "No memory for the colour table, using factored tables");
+    }
+
+    int64_t start = esp_timer_get_time();
+    lcd_cc_set(profile, colour_table);
+    int64_t built = esp_timer_get_time() - start;
+
+    printf("palette: '%s' correction from %s, built in %lld us\n",
+        lcd_cc_name(profile), colour_table ? (COLOUR_TABLE == COLOUR_TABLE_PSRAM ? "psram table" : "dram table") : "factored tables",
+        built);
+}
 
-    xv = (int) ((x_ratio * x)>>16);
-    yv = (int) ((y_ratio * y)>>16);
+// What a CGB palette write costs for each profile and table placement, over all 32768 colours in scattered order
+static void colour_bench() {
+    static const char* placements[] = {"factored tables", "dram table", "psram table"};
+    static const uint32_t caps[] = {0, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, MALLOC_CAP_SPIRAM};
+
+    for (int placement = 0; placement < 3; placement++) {
+        uint16_t* table = NULL;
+        if (placement > 0) {
+            table = heap_caps_malloc(32768 * sizeof(uint16_t), caps[placement]);
+            if (table == NULL) {
+                printf("palette: no memory for a %s\n", placements[placement]);
+                continue;
+            }
+        }
+        for (int profile = 0; profile < LCD_CC_COUNT; profile++) {
+            lcd_cc_set(profile, table);
+            uint32_t sum = 0;
+            int64_t start = esp_timer_get_time();
+            for (int i = 0; i < 32768; i++) {
+                sum += lcd_cc_color((i * 4099) & 0x7fff);
+            }
+            int64_t elapsed = esp_timer_get_time() - start;
+            printf("palette: '%s' from %s, %lld ns per colour (sum %08x)\n",
+                lcd_cc_name(profile), placements[placement], elapsed * 1000 / 32768, sum);
+        }
+        if (table != NULL) heap_caps_free(table);
+    }
+}
+
+// Performance HUD, drawn into the rows above the game window when the geometry leaves room for it, as 1.5x does
+#define HUD_LINES  (2)
+#define HUD_HEIGHT (HUD_LINES * HUD_LINE_HEIGHT)
+
+static volatile bool hud_enabled = false;
+static char hud_lines[2][HUD_LINES][81];
+static atomic_int hud_ready = -1;
+
+// Kept by the display side for the HUD
+static volatile uint32_t frames_presented = 0;
+static volatile int64_t display_time = 0;
+static int64_t sound_time = 0;
+static int64_t audio_wait_time = 0; // Emulator blocked in pcm_submit() on a full audio ring
+
+typedef enum _display_mode {
+    DISPLAY_MODE_BORDER = 0,
+    DISPLAY_MODE_UNSCALED,
+    DISPLAY_MODE_FIT,
+    DISPLAY_MODE_ASPECT,
+    DISPLAY_MODE_STRETCH,
+    DISPLAY_MODE_COUNT
+} display_mode_t;
+
+// An output window on the panel with everything needed to fill it, built once at startup
+typedef struct _display_geometry {
+    const char* name;
+    int x;
+    int y;
+    int lines; // Output rows per transfer, as many as fit in one line buffer
+    scaler_plan_t plan;
+    uint32_t frames;
+    int64_t time;
+    int64_t scale_time;
+} display_geometry_t;
+
+static display_geometry_t geometries[DISPLAY_MODE_COUNT];
+static volatile display_mode_t display_mode = DISPLAY_MODE_BORDER;
+
+// Set whenever the game window on the panel was drawn over, the next frame is then sent whole
+static volatile bool display_redraw = true;
+
+// Bytes sent to and spared from the panel by only sending bands with changed lines
+static uint64_t spi_bytes_sent = 0;
+static uint64_t spi_bytes_saved = 0;
+static uint32_t frames_unchanged = 0;
+
+static void display_geometry_init(display_mode_t mode, const char* name, scaler_mode_t filter, int width, int height) {
+    display_geometry_t* g = &geometries[mode];
+    g->name = name;
+    g->x = (ILI9341_WIDTH - width) / 2;
+    g->y = (ILI9341_HEIGHT - height) / 2;
+    g->lines = (ILI9341_WIDTH * LINE_COUNT) / width;
+    if (g->lines > height) g->lines = height;
+    scaler_plan(&g->plan, filter, GAMEBOY_WIDTH, GAMEBOY_HEIGHT, width, height);
+}
 
-    x_diff = ((x_ratio * x)>>16) - (xv);
-    y_diff = ((y_ratio * y)>>16) - (yv);
+void display_geometries_init() {
+    display_geometry_init(DISPLAY_MODE_BORDER, "Border", DISPLAY_SCALER,
+        GAMEBOY_WIDTH + (ILI9341_HEIGHT - 50 - GAMEBOY_HEIGHT), ILI9341_HEIGHT - 50);
+    display_geometry_init(DISPLAY_MODE_UNSCALED, "1:1", SCALER_NEAREST, GAMEBOY_WIDTH, GAMEBOY_HEIGHT);
+    display_geometry_init(DISPLAY_MODE_FIT, "1.5x", DISPLAY_SCALER, GAMEBOY_WIDTH * 3 / 2, GAMEBOY_HEIGHT * 3 / 2);
+    display_geometry_init(DISPLAY_MODE_ASPECT, "Full height", DISPLAY_SCALER,
+        GAMEBOY_WIDTH * ILI9341_HEIGHT / GAMEBOY_HEIGHT, ILI9341_HEIGHT);
+    display_geometry_init(DISPLAY_MODE_STRETCH, "Stretch", DISPLAY_SCALER, ILI9341_WIDTH, ILI9341_HEIGHT);
+}
+
+void display_mode_set(int mode) {
+    if (mode < 0 || mode >= DISPLAY_MODE_COUNT) mode = DISPLAY_MODE_BORDER;
+    display_mode = mode;
+}
+
+// Draws whatever surrounds the game window for the current mode
+void display_background() {
+    display_redraw = true;
+    if (display_mode == DISPLAY_MODE_BORDER) {
+        pax_draw_image(&pax_buffer, &border, 0, 0);
+    } else {
+        pax_background(&pax_buffer, 0);
+    }
+    disp_flush();
+}
 
-    index = yv*w1+xv ;
+// Expanded RGB565 rows of an indexed or blended frame, one more entry than needed for the right neighbour
+static uint16_t row_cache[2][GAMEBOY_WIDTH + 1];
+static int row_cache_y[2];
 
-    a = bufs[index];
-    b = bufs[index+1];
-    c = bufs[index+w1];
-    d = bufs[index+w1+1];
+static void expand_row(const uint8_t* data, int y, uint16_t* row) {
+    if (!fb.indexed) {
+        memcpy(row, data + y * GAMEBOY_WIDTH * 2, GAMEBOY_WIDTH * 2);
+        return;
+    }
+    const struct fbpal* fp = FB_PAL(data);
+    const uint16_t* pal = fp->pal[fp->line[y]];
+    const uint8_t* src = data + y * GAMEBOY_WIDTH;
+    for (int x = 0; x < GAMEBOY_WIDTH; x++) {
+        row[x] = pal[src[x]];
+    }
+}
 
-    red = (((a >> 11) & 0x1f) * (1-x_diff) * (1-y_diff) + ((b >> 11) & 0x1f) * (x_diff) * (1-y_diff) +
-        ((c >> 11) & 0x1f) * (y_diff) * (1-x_diff) + ((d >> 11) & 0x1f) * (x_diff * y_diff));
+static const uint16_t* frame_row(const uint8_t* data, int y) {
+    if (y >= GAMEBOY_HEIGHT) y = GAMEBOY_HEIGHT - 1;
+    if (!fb.indexed && !fb.blend) return ((const uint16_t*) data) + y * GAMEBOY_WIDTH;
+
+    uint16_t* row = row_cache[y & 1];
+    if (row_cache_y[y & 1] != y) {
+        expand_row(data, y, row);
+        if (fb.blend) {
+            uint16_t other[GAMEBOY_WIDTH];
+            expand_row(data + FRAMEBUFFER_SIZE, y, other);
+            for (int x = 0; x < GAMEBOY_WIDTH; x++) {
+                row[x] = AVERAGE(row[x], other[x]);
+            }
+        }
+        row[GAMEBOY_WIDTH] = row[GAMEBOY_WIDTH - 1];
+        row_cache_y[y & 1] = y;
+    }
+    return row;
+}
 
-    green = (((a >> 5) & 0x3f) * (1-x_diff) * (1-y_diff) + ((b >> 5) & 0x3f) * (x_diff) * (1-y_diff) +
-        ((c >> 5) & 0x3f) * (y_diff) * (1-x_diff) + ((d >> 5) & 0x3f) * (x_diff * y_diff));
+static inline bool line_dirty(const uint32_t* dirty, int y) {
+    return (dirty[y >> 5] >> (y & 31)) & 1;
+}
 
-    blue = (((a) & 0x1f) * (1-x_diff) * (1-y_diff) + ((b) & 0x1f) * (x_diff) * (1-y_diff) +
-        ((c) & 0x1f) * (y_diff) * (1-x_diff) + ((d) & 0x1f) * (x_diff * y_diff));
+// Whether any source line read by output rows [y, y + count) changed
+static bool band_dirty(const scaler_plan_t* plan, const uint32_t* dirty, int y, int count) {
+    for (int i = y; i < y + count; i++) {
+        int yv = plan->row[i];
+        if (line_dirty(dirty, yv)) return true;
+        if (plan->row_weight[i] && line_dirty(dirty, yv + 1)) return true;
+    }
+    return false;
+}
 
-    col = ((int)red << 11) | ((int)green << 5) | ((int)blue);
+// Sends the latest HUD text, if there is new text and room above the game window
+static void hud_present(const display_geometry_t* g) {
+    int slot = atomic_exchange(&hud_ready, -1);
+    if (slot < 0 || !hud_enabled || g->y < HUD_HEIGHT) return;
 
-    return col;
+    uint16_t* target = display_line_acquire();
+    hud_fill(target, ILI9341_WIDTH, HUD_HEIGHT, 0x0000);
+    for (int i = 0; i < HUD_LINES; i++) {
+        hud_text(target, ILI9341_WIDTH, HUD_HEIGHT, 1, i * HUD_LINE_HEIGHT, hud_lines[slot][i], 0xffff);
+    }
+    display_line_submit(target, 0, 0, ILI9341_WIDTH, HUD_HEIGHT);
 }
 
-void write_gb_frame(const uint16_t * data) {
-    short x,y;
-    int sending_line=-1;
-    int calc_line=0;
-    
+void write_gb_frame(const uint8_t * data, const uint32_t* dirty) {
     if (data == NULL) return;
+
+    display_geometry_t* g = &geometries[display_mode];
+    const scaler_plan_t* plan = &g->plan;
+    int64_t frameStart = esp_timer_get_time();
+    bool redraw = display_redraw;
+    bool changed = false;
+    display_redraw = false;
+
+    row_cache_y[0] = row_cache_y[1] = -1;
     
-    bool scaling = true;
-    
-    if (scaling) {            
-        int outputHeight = ILI9341_HEIGHT - 50;
-        int outputWidth = GAMEBOY_WIDTH + (ILI9341_HEIGHT - 50 - GAMEBOY_HEIGHT);
-        int xpos = (ILI9341_WIDTH - outputWidth) / 2;
-        for (y=0; y<outputHeight; y+=LINE_COUNT)  {
-            for (int i = 0; i < LINE_COUNT; ++i)
-            {
-                if((y + i) >= outputHeight) break;
+    for (int y = 0; y < plan->dst_height; y += g->lines) {
+        int count = plan->dst_height - y;
+        if (count > g->lines) count = g->lines;
 
-                int index = (i) * outputWidth;
-            
-                for (x=0; x<outputWidth; ++x) 
-                {
-                    
-                    uint16_t sample = getPixel(data, x, (y+i), GAMEBOY_WIDTH, GAMEBOY_HEIGHT, outputWidth, outputHeight);
-                    line[calc_line][index]=((sample >> 8) | ((sample) << 8));
-                    index++;
-                }
-            }
-            sending_line=calc_line;
-            calc_line = (calc_line + 1) % LINE_BUFFERS;
-            ili9341_write_partial_direct(ili9341, (uint8_t*) line[sending_line], xpos, y + 25, outputWidth, LINE_COUNT);
+        if (!redraw && !band_dirty(plan, dirty, y, count)) {
+            spi_bytes_saved += plan->dst_width * count * sizeof(uint16_t);
+            continue;
+        }
+        changed = true;
+
+        uint16_t* target = display_line_acquire();
+        int64_t start = esp_timer_get_time();
+        for (int i = 0; i < count; ++i) {
+            int yv = plan->row[y + i];
+            const uint16_t* bottom = frame_row(data, yv + 1);
+            const uint16_t* top = frame_row(data, yv);
+            scaler_row(plan, top, bottom, y + i, target + i * plan->dst_width);
         }
+        g->scale_time += esp_timer_get_time() - start;
+
+        display_line_submit(target, g->x, g->y + y, plan->dst_width, count);
+        spi_bytes_sent += plan->dst_width * count * sizeof(uint16_t);
     }
-    else
-    {
-        int ypos = (ILI9341_HEIGHT - GAMEBOY_HEIGHT)/2;
-        int xpos = (ILI9341_WIDTH - GAMEBOY_WIDTH)/2;
 
-        for (y=0; y<GAMEBOY_HEIGHT; y+=LINE_COUNT_UNSCALED)
-        {
-            for (int i = 0; i < LINE_COUNT_UNSCALED; ++i)
-            {
-                if((y + i) >= GAMEBOY_HEIGHT) break;
+    if (!changed) frames_unchanged++;
+    hud_present(g);
+    int64_t elapsed = esp_timer_get_time() - frameStart;
+    g->time += elapsed;
+    g->frames++;
+    display_time += elapsed;
+    frames_presented++;
+}
 
-                int index = (i) * GAMEBOY_WIDTH;
-                int bufferIndex = ((y + i) * GAMEBOY_WIDTH);
+typedef struct _beam_band {
+    uint8_t* data;
+    int y;
+    int count;
+    int64_t timestamp;
+} beam_band_t;
 
-                for (x = 0; x < GAMEBOY_WIDTH; ++x)
-                {
-                    uint16_t sample = data[bufferIndex++];
-                    line[calc_line][index++] = ((sample >> 8) | ((sample & 0xff) << 8));
-                }
-            }
-            sending_line=calc_line;
-            calc_line=(calc_line==1)?0:1;
-            ili9341_write_partial_direct(ili9341, (uint8_t*) line[sending_line], xpos, y+ypos, GAMEBOY_WIDTH, LINE_COUNT_UNSCALED);
+uint8_t* beamBuffer[BEAM_BANDS];
+
+static int beam_output_row = 0;
+
+// The last line of the previous band, the lower bilinear tap of the rows scaled from it
+static uint16_t beam_carry[GAMEBOY_WIDTH];
+
+// Called by the LCD for every completed band of lines, returns the band to draw into next
+uint8_t* beam_band(uint8_t* data, int y, int count) {
+    beam_band_t band = {data, y, count, esp_timer_get_time()};
+    xQueueSend(vidQueue, &band, portMAX_DELAY);
+    uint8_t* next;
+    xQueueReceive(beamFreeQueue, &next, portMAX_DELAY);
+    framebuffer = next;
+    return next;
+}
+
+static const uint16_t* beam_row(const beam_band_t* band, int y) {
+    if (y < band->y) return beam_carry;
+    if (y >= GAMEBOY_HEIGHT) y = GAMEBOY_HEIGHT - 1;
+    return ((const uint16_t*) band->data) + (y - band->y) * GAMEBOY_WIDTH;
+}
+
+void write_gb_band(const beam_band_t* band) {
+    static display_geometry_t* g = NULL;
+    int end = band->y + band->count;
+    // Rows from the last line wait for the first line of the next band
+    int ready = (end == GAMEBOY_HEIGHT) ? end : end - 1;
+
+    // The mode can only change between frames
+    if (band->y == 0 || g == NULL) {
+        g = &geometries[display_mode];
+        beam_output_row = 0;
+    }
+    const scaler_plan_t* plan = &g->plan;
+
+    int64_t start = esp_timer_get_time();
+    while (beam_output_row < plan->dst_height && plan->row[beam_output_row] < ready) {
+        int first = beam_output_row;
+        int count = 0;
+        uint16_t* target = display_line_acquire();
+        while (count < g->lines && beam_output_row < plan->dst_height) {
+            int yv = plan->row[beam_output_row];
+            if (yv >= ready) break;
+            scaler_row(plan, beam_row(band, yv), beam_row(band, yv + 1), beam_output_row, target + count * plan->dst_width);
+            count++;
+            beam_output_row++;
         }
+        bool last = beam_output_row >= plan->dst_height || plan->row[beam_output_row] >= ready;
+        display_line_submit_stamped(target, g->x, g->y + first, plan->dst_width, count, last ? band->timestamp : 0);
+    }
+    memcpy(beam_carry, beam_row(band, end - 1), sizeof(beam_carry));
+    if (end == GAMEBOY_HEIGHT) hud_present(g);
+    int64_t elapsed = esp_timer_get_time() - start;
+    g->time += elapsed;
+    display_time += elapsed;
+    if (end == GAMEBOY_HEIGHT) {
+        g->frames++;
+        frames_presented++;
     }
 }
 
-volatile bool videoTaskIsRunning = false;
-void videoTask(void *arg) {
-  videoTaskIsRunning = true;
-  uint16_t* param;
-  while(1) {
-        xQueuePeek(vidQueue, &param, portMAX_DELAY);
-        if (param == (uint16_t*) 1) break;
-        write_gb_frame(param);
-        xQueueReceive(vidQueue, &param, portMAX_DELAY);
-    }
-    videoTaskIsRunning = false;
+volatile bool beamTaskIsRunning = false;
+void beamTask(void *arg) {
+    beamTaskIsRunning = true;
+    beam_band_t band;
+    while (1) {
+        xQueueReceive(vidQueue, &band, portMAX_DELAY);
+        if (band.data == NULL) break;
+        write_gb_band(&band);
+        xQueueSend(beamFreeQueue, &band.data, portMAX_DELAY);
+    }
+    beamTaskIsRunning = false;
     vTaskDelete(NULL);
 }
 
+// Lines that changed between the frame last sent and frame seq, everything if that history is gone.
+// A blended frame also depends on the frame before it, so the changes of the last sent one count too.
+static void frame_dirty(uint32_t last, uint32_t seq, uint32_t* dirty) {
+    if (last == 0 || seq - last > DIRTY_HISTORY) {
+        memset(dirty, 0xff, LCD_DIRTY_WORDS * sizeof(uint32_t));
+        return;
+    }
+    memset(dirty, 0, LCD_DIRTY_WORDS * sizeof(uint32_t));
+    for (uint32_t s = DISPLAY_BLEND ? last : last + 1; s != seq + 1; s++) {
+        for (int i = 0; i < LCD_DIRTY_WORDS; i++) {
+            dirty[i] |= dirtyHistory[s % DIRTY_HISTORY][i];
+        }
+    }
+    // The emulator may have lapped the history while it was read
+    if (atomic_load(&publishedSeq) - last >= DIRTY_HISTORY - 1) {
+        memset(dirty, 0xff, LCD_DIRTY_WORDS * sizeof(uint32_t));
+    }
+}
+
+// Runs for as long as the emulator does, the app restarts to leave a game
+void videoTask(void *arg) {
+    unsigned int owned = 2;
+    uint32_t lastSeq = 0;
+    uint32_t dirty[LCD_DIRTY_WORDS];
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (!handoff_take(&displayLatest, &owned)) continue;
+        uint32_t seq = displaySeq[owned];
+        frame_dirty(lastSeq, seq, dirty);
+        lastSeq = seq;
+        write_gb_frame(displayBuffer[owned], dirty);
+    }
+}
+
+// Publishes the finished frame and moves the emulator on to a free buffer without blocking
+static void present_frame() {
+    uint32_t seq = atomic_load(&publishedSeq) + 1;
+    memcpy(dirtyHistory[seq % DIRTY_HISTORY], lcd_dirty, sizeof(lcd_dirty));
+    memset(lcd_dirty, 0, sizeof(lcd_dirty));
+    displaySeq[currentBuffer] = seq;
+    atomic_store(&publishedSeq, seq);
+
+    bool dropped;
+    currentBuffer = handoff_publish(&displayLatest, currentBuffer, &dropped);
+    if (dropped) framesDropped++;
+    framebuffer = displayBuffer[currentBuffer];
+    fb.ptr = framebuffer;
+    xTaskNotifyGive(videoTaskHandle);
+}
+
 void run_to_vblank() {
   /* FRAME BEGIN */
 
@@ -330,30 +740,17 @@ void run_to_vblank() {
 
   /* VBLANK BEGIN */
 
-  if ((frame % 2) == 0) {
-      xQueueSend(vidQueue, &framebuffer, portMAX_DELAY);
-      // swap buffers
-      currentBuffer = currentBuffer ? 0 : 1;
-      framebuffer = displayBuffer[currentBuffer];
-      fb.ptr = (uint8_t*) framebuffer;
+  // A lag frame was not drawn, the panel already shows what it would have looked like
+  if (((frame % 2) == 0) && !DISPLAY_BEAM && !lcd_lagframe) {
+      present_frame();
   }
   rtc_tick();
 
+  int64_t soundStart = esp_timer_get_time();
   sound_mix();
+  sound_time += esp_timer_get_time() - soundStart;
 
-  if (pcm.pos > 100)
-  {
-        currentAudioBufferPtr = (int16_t*) audioBuffer[currentAudioBuffer];
-        currentAudioSampleCount = pcm.pos;
-
-        void* tempPtr = (void*) 0x1234;
-        xQueueSend(audioQueue, &tempPtr, portMAX_DELAY);
-
-        // Swap buffers
-        currentAudioBuffer = currentAudioBuffer ? 0 : 1;
-        pcm.buf = audioBuffer[currentAudioBuffer];
-        pcm.pos = 0;
-  }
+  pcm_submit();
 
   if (!(R_LCDC & 0x80)) {
     /* LCDC operation stopped */
@@ -508,6 +905,59 @@ size_t sdcard_copy_file_to_memory(const char* path, void* ptr)
     return ret;
 }
 
+// DMG palette: one of the built-in presets, or LCD_DMG_PRESETS for the palette file next to the ROM
+static int dmg_palette = 0;
+static bool dmg_user_loaded = false;
+static int dmg_user[4][4];
+
+// "<rom>.pal" holds 4 (all maps), 12 (BG, OBJ0, OBJ1) or 16 (BG, window, OBJ0, OBJ1) RRGGBB colours
+static bool load_dmg_palette() {
+    dmg_user_loaded = false;
+    char* pathName = create_savefile_path(rom_filename, "pal");
+    if (pathName == NULL) return false;
+    FILE* f = fopen(pathName, "r");
+    free(pathName);
+    if (f == NULL) return false;
+
+    int colours[16];
+    int count = 0;
+    char word[16];
+    while (count < 16 && fscanf(f, " %15s", word) == 1) {
+        char* end;
+        long value = strtol(word[0] == '#' ? word + 1 : word, &end, 16);
+        if (*end != '\0') continue;
+        colours[count++] = ((value & 0xff) << 16) | (value & 0xff00) | ((value >> 16) & 0xff);
+    }
+    fclose(f);
+
+    static const int maps[3][4] = {{0, 0, 0, 0}, {0, 0, 1, 2}, {0, 1, 2, 3}};
+    int layout = (count == 4) ? 0 : (count == 12) ? 1 : (count == 16) ? 2 : -1;
+    if (layout < 0) {
+        ESP_LOGW(TAG, "Palette file needs 4, 12 or 16 colours, found %d", count);
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        memcpy(dmg_user[i], &colours[maps[layout][i] * 4], sizeof(dmg_user[i]));
+    }
+    dmg_user_loaded = true;
+    return true;
+}
+
+void dmg_palette_set(int palette) {
+    if (palette < 0 || palette > LCD_DMG_PRESETS) palette = 0;
+    if (palette == LCD_DMG_PRESETS && !dmg_user_loaded) palette = 0;
+    dmg_palette = palette;
+    if (palette == LCD_DMG_PRESETS) {
+        lcd_dmg_palette(dmg_user);
+    } else {
+        lcd_dmg_preset(palette);
+    }
+}
+
+const char* dmg_palette_name() {
+    return (dmg_palette == LCD_DMG_PRESETS) ? "ROM palette file" : lcd_dmg_preset_name(dmg_palette);
+}
+
 bool load_state() {
     printf("LOADING STATE\n");
     if (rom_filename[0] == '\0') {
@@ -601,35 +1051,153 @@ void save_sram() {
 }
 
 
+// Producer side: samples up to head were all mixed by the given time, dropped if the audio task is behind
+static void audio_stamp(unsigned head, int64_t time) {
+    unsigned slot = atomic_load(&stampHead);
+    if (slot - atomic_load(&stampTail) >= AUDIO_STAMPS) return;
+    audioStamps[slot % AUDIO_STAMPS].head = head;
+    audioStamps[slot % AUDIO_STAMPS].time = time;
+    atomic_store(&stampHead, slot + 1);
+}
+
+// Consumer side: samples before end have just been queued, so each stamp among them reaches the DAC
+// once the DMA buffers ahead of end have played, less the samples that follow it
+static void audio_latency(unsigned end, int64_t now) {
+    unsigned slot = atomic_load(&stampTail);
+    while (slot != atomic_load(&stampHead) && (int) (audioStamps[slot % AUDIO_STAMPS].head - end) <= 0) {
+        int64_t dac = now + AUDIO_DMA_US - (int64_t) ((end - audioStamps[slot % AUDIO_STAMPS].head) >> 1) * 1000000 / pcm.hz;
+        int64_t latency = dac - audioStamps[slot % AUDIO_STAMPS].time;
+        // Stamps left waiting while the menu was up say nothing about latency
+        if (latency < 1000000) {
+            latencyTotal += latency;
+            latencyCount++;
+            if (latency < latencyMin) latencyMin = latency;
+            if (latency > latencyMax) latencyMax = latency;
+        }
+        atomic_store(&stampTail, ++slot);
+    }
+}
+
+// Low-latency mode: grows the DMA buffers after underruns and trims them once playback has been steady
+static void audio_adapt(int64_t now) {
+    static int64_t next = 0;
+    static unsigned underflows = 0;
+    static int quiet = 0;
+    static int patience = AUDIO_PATIENCE;
+    static bool trimmed = false;
+
+    if (!AUDIO_LOW_LATENCY || now < next) return;
+    next = now + AUDIO_ADAPT_US;
+
+    int frames = audioFrames;
+    if (pcm.underflows != underflows) {
+        if (trimmed && patience < AUDIO_PATIENCE_MAX) patience *= 2;
+        frames *= 2;
+        quiet = 0;
+    } else if (++quiet >= patience) {
+        frames = frames * 3 / 4;
+        quiet = 0;
+    }
+    underflows = pcm.underflows;
+    if (frames > AUDIO_DMA_FRAMES) frames = AUDIO_DMA_FRAMES;
+    if (frames < AUDIO_DMA_MIN_FRAMES) frames = AUDIO_DMA_MIN_FRAMES;
+    frames &= ~7;
+    trimmed = frames < audioFrames;
+    if (frames == audioFrames) return;
+
+    audio_dma_frames_set(frames);
+    audioFrames = frames;
+    pcm.target = AUDIO_TARGET;
+    audioResizes++;
+}
+
+// Blocks for at least us microseconds, in whole ticks
+void sys_sleep(int us) {
+    if (us <= 0) return;
+    TickType_t ticks = pdMS_TO_TICKS((us + 999) / 1000);
+    vTaskDelay(ticks ? ticks : 1);
+}
+
+// Wakes the audio task and holds the emulator back while it is more than the high watermark ahead
 int pcm_submit() {
-    audio_submit(currentAudioBufferPtr, currentAudioSampleCount >> 1);
+    frameEnd = esp_timer_get_time();
+    if (!sound_deferred) audio_stamp(pcm.head, frameEnd);
+    xTaskNotifyGive(audioTaskHandle);
+    if (pcm_fill() > AUDIO_HIGH_WATERMARK) {
+        while (pcm_fill() > AUDIO_HIGH_WATERMARK) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        }
+        audio_wait_time += esp_timer_get_time() - frameEnd;
+    }
     return 1;
 }
 
-volatile bool AudioTaskIsRunning = false;
-void audioTask(void* arg) {
-  uint16_t* param;
-
-  AudioTaskIsRunning = true;
-  while(1) {
-    xQueuePeek(audioQueue, &param, portMAX_DELAY);
-    if (param == 0) {
-        // TODO: determine if this is still needed
-        abort();
-    } else if (param == 1) {
-        break;
-    } else {
-        pcm_submit();
+// Renders the logged register writes and passes the new samples on to the audio task
+void synthTask(void* arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t produced = frameEnd;
+        sound_synth();
+        audio_stamp(pcm.head, produced);
+        xTaskNotifyGive(audioTaskHandle);
     }
-    xQueueReceive(audioQueue, &param, portMAX_DELAY);
-  }
+}
+
+static void synth_notify() {
+    xTaskNotifyGive(synthTaskHandle);
+}
+
+// Lets the synth task catch up, so the sound state can be saved, loaded or reset
+static void synth_wait() {
+    if (!sound_deferred) return;
+    synth_notify();
+    while (!sound_idle()) {
+        vTaskDelay(1);
+    }
+}
 
-  printf("audioTask: exiting.\n");
+// When the queued DMA buffers run out, in the low bits of esp_timer_get_time() so reads are atomic
+static atomic_uint audioPlayEnd = 0;
 
-  AudioTaskIsRunning = false;
-  vTaskDelete(NULL);
+// Samples the audio task handed to I2S that have not played yet, for the mixer's rate control
+static int audio_queued() {
+    int us = (int) (atomic_load(&audioPlayEnd) - (uint32_t) esp_timer_get_time());
+    return us > 0 ? (int) ((int64_t) us * pcm.hz * 2 / 1000000) : 0;
+}
+
+// Drains the pcm ring into I2S one DMA buffer at a time
+void audioTask(void* arg) {
+    int64_t deadline = 0;
+    bool starved = false;
 
-  while (1) {}
+    while (1) {
+        if (pcm_fill() < AUDIO_CHUNK) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            // Waking after the DMA buffers ran out means the speaker went quiet
+            if (!starved && audio_is_active() && esp_timer_get_time() > deadline) {
+                pcm.underflows++;
+                starved = true;
+            }
+            continue;
+        }
+        int count;
+        int16_t* samples = pcm_peek(&count);
+        if (count > AUDIO_CHUNK) count = AUDIO_CHUNK;
+        audio_submit(samples, count >> 1);
+        pcm_release(count);
+        int64_t now = esp_timer_get_time();
+        audio_latency(pcm.tail, now);
+        audio_adapt(now);
+        // audio_submit() returns once the chunk is queued behind the others, at most a full set of buffers ahead
+        if (deadline < now) deadline = now;
+        deadline += (int64_t) (count >> 1) * 1000000 / pcm.hz;
+        if (deadline > now + AUDIO_DMA_US) deadline = now + AUDIO_DMA_US;
+        atomic_store(&audioPlayEnd, (uint32_t) deadline);
+        starved = false;
+        if (pcm_fill() <= AUDIO_HIGH_WATERMARK) {
+            xTaskNotifyGive(emulatorTaskHandle);
+        }
+    }
 }
 
 uint8_t* load_file_to_ram(FILE* fd, size_t* fsize) {
@@ -652,7 +1220,13 @@ typedef enum action {
     ACTION_EXIT,
     ACTION_VOLUME_DOWN,
     ACTION_VOLUME_UP,
-    ACTION_RESET
+    ACTION_RESET,
+    ACTION_DISPLAY,
+    ACTION_COLOURS,
+    ACTION_PALETTE,
+    ACTION_HUD,
+    ACTION_SOUND,
+    ACTION_RATE
 } menu_action_t;
 
 static size_t menu_pos = 0;
@@ -700,6 +1274,12 @@ menu_action_t show_menu() {
     menu_insert_item_icon(menu, "Load state", NULL, (void*) ACTION_LOAD_STATE, -1, &icon_state_load);
     menu_insert_item_icon(menu, "Save state", NULL, (void*) ACTION_STORE_STATE, -1, &icon_state_save);
     menu_insert_item_icon(menu, "Reset state", NULL, (void*) ACTION_RESET, -1, &icon_play);
+    menu_insert_item_icon(menu, "Display", NULL, (void*) ACTION_DISPLAY, -1, &icon_joystick);
+    menu_insert_item_icon(menu, "Colours", NULL, (void*) ACTION_COLOURS, -1, &icon_joystick);
+    menu_insert_item_icon(menu, "Palette", NULL, (void*) ACTION_PALETTE, -1, &icon_joystick);
+    menu_insert_item_icon(menu, "Perf. HUD", NULL, (void*) ACTION_HUD, -1, &icon_joystick);
+    menu_insert_item_icon(menu, "Sound", NULL, (void*) ACTION_SOUND, -1, &icon_joystick);
+    menu_insert_item_icon(menu, "Sample rate", NULL, (void*) ACTION_RATE, -1, &icon_joystick);
     
     bool render = true;
     bool quit = false;
@@ -788,9 +1368,14 @@ void reset_and_init() {
     memset(&fb, 0, sizeof(fb));
     fb.w = 160;
     fb.h = 144;
-    fb.pelsize = 2;
+    fb.pelsize = (FRAMEBUFFER_INDEXED && !DISPLAY_BEAM) ? 1 : 2;
     fb.pitch = fb.w * fb.pelsize;
-    fb.indexed = 0;
+    fb.indexed = FRAMEBUFFER_INDEXED && !DISPLAY_BEAM;
+    fb.blend = DISPLAY_BLEND && !DISPLAY_BEAM;
+    if (DISPLAY_BEAM) {
+        fb.bandlines = BEAM_LINES;
+        fb.band = beam_band;
+    }
     fb.ptr = framebuffer;
     fb.enabled = 1;
     fb.dirty = 0;
@@ -978,9 +1563,12 @@ bool load_rom(bool browser, bool sd_card) {
     }
 
     loader_init(rom_data);
+    if (load_dmg_palette()) printf("DMG palette loaded from file\n");
+    dmg_palette_set(dmg_palette);
     reset_and_init();
     lcd_begin();
     sound_reset();
+    memset(&lcd_stats, 0, sizeof(lcd_stats));
     
     display_state("ROM loaded", 100);
     
@@ -989,44 +1577,144 @@ bool load_rom(bool browser, bool sd_card) {
     return true;
 }
 
+void print_render_stats() {
+    if (lcd_stats.frames == 0) return;
+    display_sync();
+    printf("render: %d of %d frames (%d%%) took the deferred path for '%s'\n",
+        lcd_stats.frames_deferred, lcd_stats.frames, lcd_stats.frames_deferred * 100 / lcd_stats.frames, rom_filename);
+    if (beam_latency_count > 0) {
+        printf("render: band latency avg %lld us, max %lld us over %u bands\n",
+            beam_latency_total / beam_latency_count, beam_latency_max, beam_latency_count);
+    }
+    printf("render: %d lag frames (no joypad reads or video changes)\n", lcd_stats.frames_lag);
+    int shown = lcd_stats.frames - lcd_stats.frames_blend;
+    if (shown > 0) {
+        // Rendering every frame in full would draw two frames of 144 lines per presented frame
+        printf("render: %d lines drawn per presented frame (%d%% of full 60 Hz rendering), %d blend frames\n",
+            lcd_stats.lines / shown, lcd_stats.lines * 100 / (shown * 2 * GAMEBOY_HEIGHT), lcd_stats.frames_blend);
+    }
+    uint32_t presented = 0;
+    for (int i = 0; i < DISPLAY_MODE_COUNT; i++) {
+        display_geometry_t* g = &geometries[i];
+        if (g->frames == 0) continue;
+        uint64_t pixels = (uint64_t) g->frames * g->plan.dst_width * g->plan.dst_height;
+        printf("render: '%s' %dx%d %s: %lld us per frame, %lld us scaling",
+            g->name, g->plan.dst_width, g->plan.dst_height, scaler_mode_name(g->plan.mode),
+            g->time / g->frames, g->scale_time / g->frames);
+        if (g->scale_time > 0) printf(", %llu output pixels per second", pixels * 1000000 / g->scale_time);
+        printf("\n");
+        presented += g->frames;
+    }
+    if (presented > 0) {
+        printf("render: spi bus busy %lld us per frame, renderer waited %lld us per frame for a line buffer\n",
+            spi_busy_time / presented, spi_wait_time / presented);
+        printf("render: %u frames dropped by the display hand-off\n", framesDropped);
+        printf("render: sent %llu spi bytes per frame, saved %llu (%llu%%), %u of %u frames unchanged\n",
+            spi_bytes_sent / presented, spi_bytes_saved / presented,
+            spi_bytes_saved * 100 / (spi_bytes_sent + spi_bytes_saved + 1), frames_unchanged, presented);
+    }
+}
+
+void print_audio_stats() {
+    for (int r = 0; r < SOUND_RATES; r++) {
+        for (int i = 0; i < SOUND_ENGINES; i++) {
+            uint64_t units = sound_stats.units[r][i];
+            if (units == 0) continue;
+            // Cycles spent mixing for every second of audio produced, units are 1 << 21 to the second
+            uint64_t cycles = (sound_stats.cycles[r][i] << 21) / units;
+            printf("sound: '%s' mixer at %dHz (mixing at %dHz) %llu cycles per second of audio (%llu.%llu%% of a core) over %llus\n",
+                sound_engine_name(i), sound_rates[r], sound_mix_hz(r, i), cycles, cycles / (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 10000),
+                cycles / (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000) % 10, units >> 21);
+        }
+    }
+    printf("sound: %u frames dropped on a full ring, %u times the i2s buffers ran dry\n", pcm.overflows, pcm.underflows);
+    if (sound_stats.fill_count > 0) {
+        printf("sound: %llu samples buffered on average for a target of %d, off by %llu on average, rate nudged %+d..%+d ppm\n",
+            sound_stats.fill / sound_stats.fill_count, pcm.target, sound_stats.fill_error / sound_stats.fill_count,
+            -sound_stats.step_max * 1000000 / 65536, -sound_stats.step_min * 1000000 / 65536);
+    }
+    uint64_t written = sound_stats.direct + sound_stats.resampled;
+    if (written > 0) {
+        printf("sound: %llu%% of samples mixed straight into the ring, %llu%% through the resampler\n",
+            sound_stats.direct * 100 / written, sound_stats.resampled * 100 / written);
+    }
+    if (sound_stats.frames > 0) {
+        printf("sound: %llu%% of frames written as silence, %llu%% of channel time skipped as inaudible\n",
+            sound_stats.silent * 100 / sound_stats.frames, sound_stats.idle * 100 / (sound_stats.frames * 4));
+    }
+    if (latencyCount > 0) {
+        printf("sound: %lld ms from the end of an emulated frame to the DAC on average (%lld..%lld ms), DMA buffers of %d frames, resized %u times\n",
+            latencyTotal / latencyCount / 1000, latencyMin / 1000, latencyMax / 1000, audioFrames, audioResizes);
+    }
+    if (sound_deferred) {
+        printf("sound: %llu register writes synthesised on the second core, %u stalls on a full log\n",
+            sound_stats.logged, sound_stats.log_stalls);
+    }
+}
+
+// Collects one second of frame timings and formats them for the HUD
+static void hud_frame(int64_t elapsed) {
+    static int64_t start = 0;
+    static uint32_t frames = 0, presented = 0, lcd = 0, lag = 0, audio = 0;
+    static int64_t emulated = 0, sound = 0, display = 0, wait = 0;
+    static int slot = 0;
+
+    int64_t now = esp_timer_get_time();
+    if (!hud_enabled) {
+        start = 0;
+        return;
+    }
+    if (start == 0) {
+        start = now;
+        frames = audio = 0;
+        emulated = 0;
+        presented = frames_presented;
+        lcd = lcd_stats.time;
+        lag = lcd_stats.frames_lag;
+        sound = sound_time;
+        display = display_time;
+        wait = audio_wait_time;
+        return;
+    }
+
+    frames++;
+    emulated += elapsed;
+    audio += pcm_fill() * 100 / AUDIO_RING_SIZE;
+    int64_t span = now - start;
+    if (span < 1000000) return;
+
+    uint32_t shown = frames_presented - presented;
+    int lcdPerFrame = (lcd_stats.time - lcd) / frames;
+    int soundPerFrame = (sound_time - sound) / frames;
+    int waitPerFrame = (audio_wait_time - wait) / frames;
+    int cpuPerFrame = emulated / frames - lcdPerFrame - soundPerFrame - waitPerFrame;
+    int displayPerFrame = shown ? (display_time - display) / shown : 0;
+    int emuFps = frames * 10000000LL / span;
+    int shownFps = shown * 10000000LL / span;
+
+    slot ^= 1;
+    snprintf(hud_lines[slot][0], sizeof(hud_lines[slot][0]), "EMU %d.%d FPS  LCD %d.%d FPS  LAG %u  AUDIO %u%%  HEAP %uK",
+        emuFps / 10, emuFps % 10, shownFps / 10, shownFps % 10, lcd_stats.frames_lag - lag,
+        audio / frames, esp_get_free_heap_size() / 1024);
+    snprintf(hud_lines[slot][1], sizeof(hud_lines[slot][1]), "US PER FRAME: CPU %d  LCD %d  SOUND %d  WAIT %d  DISPLAY %d",
+        cpuPerFrame, lcdPerFrame, soundPerFrame, waitPerFrame, displayPerFrame);
+    atomic_store(&hud_ready, slot);
+    start = 0;
+}
+
 void game_loop() {
     if (rom_filename[0] == '\0') {
         show_error("No ROM loaded", 100);
         return;
     }
-    pax_draw_image(&pax_buffer, &border, 0, 0);
-    disp_flush();
+    display_background();
 
-    uint startTime;
-    uint stopTime;
-    uint totalElapsedTime = 0;
-    uint actualFrameCount = 0;
-        
     bool quit = false;
     while (!quit) {
-        //startTime = xthal_get_ccount();
+        int64_t frameStart = esp_timer_get_time();
         run_to_vblank();
-        /*stopTime = xthal_get_ccount();
-
-        if (stopTime > startTime) {
-            elapsedTime = (stopTime - startTime);
-        } else {
-            elapsedTime = ((uint64_t)stopTime + (uint64_t)0xffffffff) - (startTime);
-        }
-
-        totalElapsedTime += elapsedTime;*/
+        hud_frame(esp_timer_get_time() - frameStart);
         ++frame;
-        /*++actualFrameCount;
-
-        if (actualFrameCount == 60) {
-          float seconds = totalElapsedTime / (CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ * 1000000.0f); // 240000000.0f; // (240Mhz)
-          float fps = actualFrameCount / seconds;
-
-          printf("HEAP:0x%x, FPS:%f\n", esp_get_free_heap_size(), fps);
-
-          actualFrameCount = 0;
-          totalElapsedTime = 0;
-        }*/
         
         rp2040_input_message_t buttonMessage = {0};
         BaseType_t queueResult;
@@ -1062,6 +1750,9 @@ void game_loop() {
                         break;
                     case RP2040_INPUT_BUTTON_HOME:
                         if (value) {
+                            synth_wait();
+                            print_render_stats();
+                            print_audio_stats();
                             audio_stop();
                             save_sram();
                             save_state();
@@ -1078,6 +1769,9 @@ void game_loop() {
             }
         } while (queueResult == pdTRUE);
     }
+    synth_wait();
+    print_render_stats();
+    print_audio_stats();
 }
 
 void app_main(void) {
@@ -1096,29 +1790,39 @@ void app_main(void) {
     
     esp_err_t res;
     
-    displayBuffer[0] = heap_caps_malloc(160 * 144 * 2, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    displayBuffer[1] = heap_caps_malloc(160 * 144 * 2, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    framebuffer = displayBuffer[0];
-    currentBuffer = 0;
-    
-    if (displayBuffer[0] == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate fb0!");
-        display_fatal_error("Failed to allocate fb0!", NULL, NULL, NULL);
-        exit_to_launcher();
-    }
-
-    if (displayBuffer[1] == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate fb1!");
-        display_fatal_error("Failed to allocate fb1!", NULL, NULL, NULL);
-        exit_to_launcher();
-    }
-    
-    for (int i = 0; i < 2; ++i){
-        memset(displayBuffer[i], 0, 160 * 144 * 2);
+    if (DISPLAY_BEAM) {
+        const size_t bandSize = GAMEBOY_WIDTH * BEAM_LINES * sizeof(uint16_t);
+        beamFreeQueue = xQueueCreate(BEAM_BANDS, sizeof(uint8_t*));
+        for (int i = 0; i < BEAM_BANDS; i++) {
+            beamBuffer[i] = heap_caps_malloc(bandSize, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
+            if (beamBuffer[i] == NULL) {
+                ESP_LOGE(TAG, "Failed to allocate band %u!", i);
+                display_fatal_error("Failed to allocate band!", NULL, NULL, NULL);
+                exit_to_launcher();
+            }
+            if (i > 0) xQueueSend(beamFreeQueue, &beamBuffer[i], 0);
+        }
+        framebuffer = beamBuffer[0];
+        printf("app_main: racing the beam with %u bands of %u bytes\n", BEAM_BANDS, bandSize);
+    } else {
+        for (int i = 0; i < FB_COUNT; i++) {
+            displayBuffer[i] = heap_caps_malloc(DISPLAY_BUFFER_SIZE, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
+            if (displayBuffer[i] == NULL) {
+                ESP_LOGE(TAG, "Failed to allocate fb%u!", i);
+                display_fatal_error("Failed to allocate framebuffer!", NULL, NULL, NULL);
+                exit_to_launcher();
+            }
+            memset(displayBuffer[i], 0, DISPLAY_BUFFER_SIZE);
+            printf("app_main: displayBuffer[%u]=%p\n", i, displayBuffer[i]);
+        }
+        framebuffer = displayBuffer[0];
+        currentBuffer = 0;
+        
+        printf("app_main: framebuffers use %u bytes (%s), rgb565: %u bytes, indexed: %u bytes\n",
+            FB_COUNT * DISPLAY_BUFFER_SIZE, FRAMEBUFFER_INDEXED ? "indexed" : "rgb565",
+            FB_COUNT * FRAMEBUFFER_SIZE_RGB565, FB_COUNT * FRAMEBUFFER_SIZE_INDEXED);
     }
     
-    printf("app_main: displayBuffer[0]=%p, [1]=%p\n", displayBuffer[0], displayBuffer[1]);
-    
     const size_t lineSize = ILI9341_WIDTH * LINE_COUNT * sizeof(uint16_t);
     for (int x = 0; x < LINE_BUFFERS; x++)
     {
@@ -1130,6 +1834,12 @@ void app_main(void) {
         }
         memset(line[x], 0, lineSize);
     }
+    spiQueue = xQueueCreate(LINE_BUFFERS, sizeof(spi_transfer_t));
+    lineFreeQueue = xQueueCreate(LINE_BUFFERS, sizeof(uint16_t*));
+    for (int x = 0; x < LINE_BUFFERS; x++) {
+        xQueueSend(lineFreeQueue, &line[x], 0);
+    }
+    xTaskCreatePinnedToCore(&spiTask, "spiTask", 2048, NULL, 6, NULL, 1);
     
     /* Start internal filesystem */
     if (mount_internal_filesystem() != ESP_OK) {
@@ -1149,12 +1859,24 @@ void app_main(void) {
         gpio_set_level(GPIO_SD_PWR, 0);  // Disable power to LEDs and SD card
     }
     
-    audio_init(AUDIO_SAMPLE_RATE);
+    if (AUDIO_LOW_LATENCY) audioFrames = AUDIO_DMA_MIN_FRAMES;
+    audio_init(AUDIO_SAMPLE_RATE, audioFrames);
 
-    vidQueue = xQueueCreate(1, sizeof(uint16_t*));
-    xTaskCreatePinnedToCore(&videoTask, "videoTask", 4096, NULL, 5, NULL, 1);
-    audioQueue = xQueueCreate(1, sizeof(uint16_t*));
-    xTaskCreatePinnedToCore(&audioTask, "audioTask", 2048, NULL, 5, NULL, 1); //768
+    display_geometries_init();
+
+    if (DISPLAY_BEAM) {
+        vidQueue = xQueueCreate(BEAM_BANDS, sizeof(beam_band_t));
+        xTaskCreatePinnedToCore(&beamTask, "beamTask", 4096, NULL, 5, NULL, 1);
+    } else {
+        xTaskCreatePinnedToCore(&videoTask, "videoTask", 4096, NULL, 5, &videoTaskHandle, 1);
+    }
+    emulatorTaskHandle = xTaskGetCurrentTaskHandle();
+    xTaskCreatePinnedToCore(&audioTask, "audioTask", 2048, NULL, 5, &audioTaskHandle, 1); //768
+    if (AUDIO_DEFERRED) {
+        xTaskCreatePinnedToCore(&synthTask, "synthTask", 3072, NULL, 5, &synthTaskHandle, 1);
+        sound_notify = synth_notify;
+        sound_deferred = 1;
+    }
 
     reset_and_init();
 
@@ -1162,20 +1884,13 @@ void app_main(void) {
     memset(&pcm, 0, sizeof(pcm));
     pcm.hz = AUDIO_SAMPLE_RATE;
     pcm.stereo = 1;
-    pcm.len = /*pcm.hz / 2*/ audioBufferLength;
-    pcm.buf = (int16_t*) heap_caps_malloc(AUDIO_BUFFER_SIZE, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    pcm.pos = 0;
+    pcm.len = AUDIO_RING_SIZE;
+    pcm.target = AUDIO_TARGET;
+    pcm.queued = audio_queued;
+    pcm.buf = (int16_t*) heap_caps_malloc(AUDIO_RING_SIZE * sizeof(int16_t), MALLOC_CAP_8BIT | MALLOC_CAP_INTERNAL);
 
-    audioBuffer[0] = (int32_t*) pcm.buf;
-    audioBuffer[1] = (int32_t*) heap_caps_malloc(AUDIO_BUFFER_SIZE, MALLOC_CAP_8BIT | MALLOC_CAP_DMA);
-    
-    if (audioBuffer[0] == NULL) {
-        show_error("Failed to allocate audio buffer 0", 100);
-        exit_to_launcher();
-    }
-    
-    if (audioBuffer[1] == NULL) {
-        show_error("Failed to allocate audio buffer 1", 100);
+    if (pcm.buf == NULL) {
+        show_error("Failed to allocate audio buffer", 100);
         exit_to_launcher();
     }
 
@@ -1184,13 +1899,40 @@ void app_main(void) {
         ESP_LOGE(TAG, "NVS open failed: %d", res);
     }
 
-    int volume;
+    int volume = audio_volume_get();
     if (nvs_get_i32(nvs_handle_gnuboy, "volume", &volume) == ESP_OK) {
         printf("Volume set to %u\r\n", volume);
-        audio_volume_set(volume);
     } else {
         printf("Failed to read volume level from NVS\r\n");
     }
+    audio_volume_set(volume);
+
+    int display;
+    if (nvs_get_i32(nvs_handle_gnuboy, "display", &display) == ESP_OK) {
+        display_mode_set(display);
+    }
+
+    if (COLOUR_BENCH) colour_bench();
+    int colours = LCD_CC_GBC;
+    nvs_get_i32(nvs_handle_gnuboy, "colours", &colours);
+    colour_profile_set(colours);
+
+    int hud = 0;
+    nvs_get_i32(nvs_handle_gnuboy, "hud", &hud);
+    hud_enabled = hud;
+
+    int engine = SOUND_STEP;
+    nvs_get_i32(nvs_handle_gnuboy, "sound", &engine);
+    sound_engine_set(engine);
+
+    int rate = sound_rate;
+    nvs_get_i32(nvs_handle_gnuboy, "rate", &rate);
+    sound_rate_set(rate);
+    audio_sample_rate_set(pcm.hz);
+
+    int palette = 0;
+    nvs_get_i32(nvs_handle_gnuboy, "palette", &palette);
+    dmg_palette = palette;
 
     nvs_get_str_fixed(nvs_handle_gnuboy, "rom", rom_filename, sizeof(rom_filename) - 1, NULL);
 
@@ -1298,6 +2040,53 @@ void app_main(void) {
                 show_message(message, 50);
                 break;
             }
+            case ACTION_DISPLAY: {
+                display_mode_set((display_mode + 1) % DISPLAY_MODE_COUNT);
+                nvs_set_i32(nvs_handle_gnuboy, "display", display_mode);
+                char message[48];
+                snprintf(message, sizeof(message), "Display set to %s\n", geometries[display_mode].name);
+                show_message(message, 50);
+                break;
+            }
+            case ACTION_COLOURS: {
+                colour_profile_set((colour_profile + 1) % LCD_CC_COUNT);
+                nvs_set_i32(nvs_handle_gnuboy, "colours", colour_profile);
+                char message[48];
+                snprintf(message, sizeof(message), "Colours set to %s\n", lcd_cc_name(colour_profile));
+                show_message(message, 50);
+                break;
+            }
+            case ACTION_PALETTE: {
+                int next = (dmg_palette + 1) % (LCD_DMG_PRESETS + (dmg_user_loaded ? 1 : 0));
+                dmg_palette_set(next);
+                nvs_set_i32(nvs_handle_gnuboy, "palette", dmg_palette);
+                char message[48];
+                snprintf(message, sizeof(message), "Palette set to %s\n", dmg_palette_name());
+                show_message(message, 50);
+                break;
+            }
+            case ACTION_HUD:
+                hud_enabled = !hud_enabled;
+                nvs_set_i32(nvs_handle_gnuboy, "hud", hud_enabled);
+                show_message(hud_enabled ? "Performance HUD on\n" : "Performance HUD off\n", 50);
+                break;
+            case ACTION_SOUND: {
+                sound_engine_set((sound_engine + 1) % SOUND_ENGINES);
+                nvs_set_i32(nvs_handle_gnuboy, "sound", sound_engine);
+                char message[48];
+                snprintf(message, sizeof(message), "Sound set to %s\n", sound_engine_name(sound_engine));
+                show_message(message, 50);
+                break;
+            }
+            case ACTION_RATE: {
+                sound_rate_set((sound_rate + 1) % SOUND_RATES);
+                audio_sample_rate_set(pcm.hz);
+                nvs_set_i32(nvs_handle_gnuboy, "rate", sound_rate);
+                char message[48];
+                snprintf(message, sizeof(message), "Sample rate set to %d Hz\n", pcm.hz);
+                show_message(message, 50);
+                break;
+            }
             default:
                 ESP_LOGW(TAG, "Action %u", (uint8_t) action);
         }
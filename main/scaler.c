@@ -0,0 +1,116 @@
+#include "scaler.h"
+
+// RGB565 spread over 32 bits with room for a 5 bit multiply: ----GGGGGG-----RRRRR------BBBBB
+#define SPREAD(c)   (((uint32_t) (c) | ((uint32_t) (c) << 16)) & 0x07e0f81fU)
+#define UNSPREAD(c) ((uint16_t) (((c) & 0xf81fU) | (((c) >> 16) & 0x07e0U)))
+#define LERP(a, b, w) (((((a) * (SCALER_WEIGHT_ONE - (w))) + ((b) * (w))) >> SCALER_WEIGHT_BITS) & 0x07e0f81fU)
+
+// The panel takes big-endian pixels
+#define SWAP(c) ((uint16_t) (((c) >> 8) | ((c) << 8)))
+
+static const char* mode_names[SCALER_MODE_COUNT] = {"nearest", "bilinear", "average"};
+
+const char* scaler_mode_name(scaler_mode_t mode) {
+    if (mode >= SCALER_MODE_COUNT) return "unknown";
+    return mode_names[mode];
+}
+
+// Maps output samples onto source samples by their centres, weight is the share of the next source sample
+static void plan_axis(scaler_mode_t mode, int src, int dst, uint8_t* index, uint8_t* weight) {
+    for (int i = 0; i < dst; i++) {
+        int pos = (int) ((((int64_t) (2 * i + 1) * src << 16) / (2 * dst)) - (1 << 15));
+        if (pos < 0) pos = 0;
+        if (mode == SCALER_NEAREST) {
+            int v = (pos + (1 << 15)) >> 16;
+            index[i] = (v >= src) ? src - 1 : v;
+            weight[i] = 0;
+            continue;
+        }
+        int v = pos >> 16;
+        int w = (pos >> (16 - SCALER_WEIGHT_BITS)) & (SCALER_WEIGHT_ONE - 1);
+        if (v >= src - 1) {
+            // Keep the right hand neighbour inside the source, fully weighted on it
+            v = src - 2;
+            w = SCALER_WEIGHT_ONE;
+        }
+        index[i] = v;
+        weight[i] = w;
+    }
+}
+
+void scaler_plan(scaler_plan_t* plan, scaler_mode_t mode, int src_width, int src_height, int dst_width, int dst_height) {
+    if (dst_width > SCALER_MAX_WIDTH) dst_width = SCALER_MAX_WIDTH;
+    if (dst_height > SCALER_MAX_HEIGHT) dst_height = SCALER_MAX_HEIGHT;
+    plan->mode = mode;
+    plan->src_width = src_width;
+    plan->src_height = src_height;
+    plan->dst_width = dst_width;
+    plan->dst_height = dst_height;
+    plan_axis(mode, src_width, dst_width, plan->col, plan->col_weight);
+    plan_axis(mode, src_height, dst_height, plan->row, plan->row_weight);
+}
+
+static void row_nearest(const scaler_plan_t* plan, const uint16_t* src, uint16_t* out) {
+    const uint8_t* col = plan->col;
+    for (int x = 0; x < plan->dst_width; x++) {
+        uint16_t c = src[col[x]];
+        out[x] = SWAP(c);
+    }
+}
+
+static void row_bilinear(const scaler_plan_t* plan, const uint16_t* top, const uint16_t* bottom, int wy, uint16_t* out) {
+    const uint8_t* col = plan->col;
+    const uint8_t* cw = plan->col_weight;
+    for (int x = 0; x < plan->dst_width; x++) {
+        int i = col[x];
+        uint32_t t = LERP(SPREAD(top[i]), SPREAD(top[i + 1]), cw[x]);
+        if (wy) {
+            uint32_t b = LERP(SPREAD(bottom[i]), SPREAD(bottom[i + 1]), cw[x]);
+            t = LERP(t, b, wy);
+        }
+        uint16_t c = UNSPREAD(t);
+        out[x] = SWAP(c);
+    }
+}
+
+// Snaps weights to 0, 1/2 or 1 so every blend is a single AVERAGE of two packed pixels
+static inline uint16_t average_pick(uint16_t a, uint16_t b, int w) {
+    if (w < SCALER_WEIGHT_ONE / 4) return a;
+    if (w > SCALER_WEIGHT_ONE * 3 / 4) return b;
+    return AVERAGE(a, b);
+}
+
+static void row_average(const scaler_plan_t* plan, const uint16_t* top, const uint16_t* bottom, int wy, uint16_t* out) {
+    const uint8_t* col = plan->col;
+    const uint8_t* cw = plan->col_weight;
+    if (wy > SCALER_WEIGHT_ONE * 3 / 4) {
+        top = bottom;
+        wy = 0;
+    } else if (wy < SCALER_WEIGHT_ONE / 4) {
+        wy = 0;
+    }
+    for (int x = 0; x < plan->dst_width; x++) {
+        int i = col[x];
+        uint16_t c = average_pick(top[i], top[i + 1], cw[x]);
+        if (wy) {
+            uint16_t b = average_pick(bottom[i], bottom[i + 1], cw[x]);
+            c = AVERAGE(c, b);
+        }
+        out[x] = SWAP(c);
+    }
+}
+
+// Scales one output row from source rows plan->row[y] (top) and the one below it (bottom) into panel byte order
+void scaler_row(const scaler_plan_t* plan, const uint16_t* top, const uint16_t* bottom, int y, uint16_t* out) {
+    switch (plan->mode) {
+        case SCALER_BILINEAR:
+            row_bilinear(plan, top, bottom, plan->row_weight[y], out);
+            break;
+        case SCALER_AVERAGE:
+            row_average(plan, top, bottom, plan->row_weight[y], out);
+            break;
+        default:
+            row_nearest(plan, top, out);
+            break;
+    }
+}
@@ -0,0 +1,113 @@
+// Output pixels per second of the display scaler on the host, for every
+// filter and the scaled geometries main.c sets up, next to getPixel(), the
+// per-pixel filter the scaler replaced.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <esp_timer.h>
+
+#include "scaler.h"
+
+#define GAMEBOY_WIDTH  (160)
+#define GAMEBOY_HEIGHT (144)
+
+static uint16_t frame[GAMEBOY_HEIGHT + 1][GAMEBOY_WIDTH + 1];
+static uint16_t out[SCALER_MAX_WIDTH];
+static volatile uint16_t sink;
+
+// As removed from main.c, including the panel byte swap done by its caller
+static uint16_t getPixel(const uint16_t * top, const uint16_t * bottom, int x, int y, int w1, int h1, int w2, int h2)
+{
+    int x_diff, y_diff, xv, yv, red , green, blue, col, a, b, c, d;
+    int x_ratio = (int) (((w1-1)<<16)/w2) + 1;
+    int y_ratio = (int) (((h1-1)<<16)/h2) + 1;
+
+    xv = (int) ((x_ratio * x)>>16);
+    yv = (int) ((y_ratio * y)>>16);
+
+    x_diff = ((x_ratio * x)>>16) - (xv);
+    y_diff = ((y_ratio * y)>>16) - (yv);
+
+    a = top[xv];
+    b = top[xv+1];
+    c = bottom[xv];
+    d = bottom[xv+1];
+
+    red = (((a >> 11) & 0x1f) * (1-x_diff) * (1-y_diff) + ((b >> 11) & 0x1f) * (x_diff) * (1-y_diff) +
+        ((c >> 11) & 0x1f) * (y_diff) * (1-x_diff) + ((d >> 11) & 0x1f) * (x_diff * y_diff));
+
+    green = (((a >> 5) & 0x3f) * (1-x_diff) * (1-y_diff) + ((b >> 5) & 0x3f) * (x_diff) * (1-y_diff) +
+        ((c >> 5) & 0x3f) * (y_diff) * (1-x_diff) + ((d >> 5) & 0x3f) * (x_diff * y_diff));
+
+    blue = (((a) & 0x1f) * (1-x_diff) * (1-y_diff) + ((b) & 0x1f) * (x_diff) * (1-y_diff) +
+        ((c) & 0x1f) * (y_diff) * (1-x_diff) + ((d) & 0x1f) * (x_diff * y_diff));
+
+    col = ((int)red << 11) | ((int)green << 5) | ((int)blue);
+
+    return col;
+}
+
+static void frame_getpixel(int width, int height) {
+    int y_ratio = ((GAMEBOY_HEIGHT - 1) << 16) / height + 1;
+    for (int y = 0; y < height; y++) {
+        const uint16_t* top = frame[(y_ratio * y) >> 16];
+        const uint16_t* bottom = top + GAMEBOY_WIDTH + 1;
+        for (int x = 0; x < width; x++) {
+            uint16_t sample = getPixel(top, bottom, x, y, GAMEBOY_WIDTH, GAMEBOY_HEIGHT, width, height);
+            out[x] = (sample >> 8) | (sample << 8);
+        }
+        sink = out[0];
+    }
+}
+
+static void frame_scaler(const scaler_plan_t* plan) {
+    for (int y = 0; y < plan->dst_height; y++) {
+        int yv = plan->row[y];
+        scaler_row(plan, frame[yv], frame[yv + 1 < GAMEBOY_HEIGHT ? yv + 1 : yv], y, out);
+        sink = out[0];
+    }
+}
+
+// Millions of output pixels per second, best of 10 runs
+static double run(int mode, int width, int height, int frames) {
+    static scaler_plan_t plan;
+    int64_t best = 0;
+
+    if (mode >= 0) scaler_plan(&plan, mode, GAMEBOY_WIDTH, GAMEBOY_HEIGHT, width, height);
+    for (int r = 0; r < 10; r++) {
+        int64_t t = esp_timer_get_time();
+        for (int f = 0; f < frames; f++) {
+            if (mode < 0) frame_getpixel(width, height);
+            else frame_scaler(&plan);
+        }
+        t = esp_timer_get_time() - t;
+        if (r == 0 || t < best) best = t;
+    }
+    return (double) width * height * frames / best;
+}
+
+int main(int argc, char** argv) {
+    static const struct { const char* name; int width, height; } geometries[] = {
+        { "1.5x", GAMEBOY_WIDTH * 3 / 2, GAMEBOY_HEIGHT * 3 / 2 },
+        { "Stretch", 320, 240 },
+    };
+    int frames = argc > 1 ? atoi(argv[1]) : 100;
+
+    srand(1);
+    for (int y = 0; y <= GAMEBOY_HEIGHT; y++) {
+        for (int x = 0; x <= GAMEBOY_WIDTH; x++) {
+            frame[y][x] = rand();
+        }
+    }
+
+    printf("%-10s %-10s %10s\n", "geometry", "filter", "Mpx/s");
+    for (int i = 0; i < (int) (sizeof(geometries) / sizeof(*geometries)); i++) {
+        for (int mode = -1; mode < SCALER_MODE_COUNT; mode++) {
+            printf("%-10s %-10s %10.1f\n", geometries[i].name, mode < 0 ? "getPixel" : scaler_mode_name(mode),
+                run(mode, geometries[i].width, geometries[i].height, frames));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * bench_sprites.c
+ *
+ * Times the CGB line compositor on the host. The scene is random
+ * tiles and attributes (a quarter of the tiles claim priority over
+ * sprites), a window over the lower half of the screen and 40 8x16
+ * sprites, 10 on every line they cover. Each scene is drawn through
+ * the scanline path (every line rendered by lcd_refreshline()) and
+ * through the deferred path (the whole frame rendered at vblank).
+ *
+ * Only lcd.c is linked, so the numbers can be compared against
+ * another revision of the renderer with GNUBOY=<path> (see Makefile).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "mem.h"
+#include "lcd.h"
+#include "fb.h"
+
+#include <esp_timer.h>
+
+struct fb fb;
+struct hw hw;
+struct ram ram;
+int frame;
+
+static un16 pixels[2][144 * 160];
+
+/* older renderers blank the display buffers directly */
+un16 *displayBuffer[2] __attribute__((weak)) = { pixels[0], pixels[1] };
+
+static void scene(int sprites, int window)
+{
+	int i, a;
+
+	srand(1);
+	memset(&lcd, 0, sizeof lcd);
+	for (i = 0; i < 0x1800; i++)
+	{
+		lcd.vbank[0][i] = rand();
+		lcd.vbank[1][i] = rand();
+	}
+	for (i = 0x1800; i < 0x2000; i++)
+	{
+		lcd.vbank[0][i] = rand();
+		a = rand() & 0x6f;
+		if ((rand() & 3) == 0) a |= 0x80;
+		lcd.vbank[1][i] = a;
+	}
+	for (i = 0; i < 128; i++)
+		lcd.pal[i] = rand();
+
+	if (sprites) for (i = 0; i < 40; i++)
+	{
+		lcd.oam.obj[i].y = 16 + (i / 10) * 36 + (i & 1) * 4;
+		lcd.oam.obj[i].x = 8 + (i % 10) * 15;
+		lcd.oam.obj[i].pat = rand();
+		lcd.oam.obj[i].flags = rand();
+	}
+
+	R_LCDC = 0x87 | (window ? 0x60 : 0);
+	R_SCX = 3;
+	R_SCY = 5;
+	R_WX = 7 + 40;
+	R_WY = 72;
+
+	vram_dirty();
+	pal_dirty();
+}
+
+static void draw(int frames, int deferred)
+{
+	int f, y;
+
+	for (f = 0; f < frames; f++)
+	{
+		/* new signatures every frame, or unchanged lines are skipped */
+		vram_dirty();
+		fb.ptr = (byte *)pixels[f & 1];
+		frame = 2;
+		lcd_begin();
+		for (y = 0; y < 144; y++)
+		{
+			R_LY = y;
+			lcd_refreshline();
+			if (!deferred && lcd_deferred) lcd_flush_deferred();
+		}
+		lcd_endframe();
+	}
+}
+
+/* returns nanoseconds per line, best of 20 runs */
+static double run(int frames, int deferred)
+{
+	int64_t t, best = 0;
+	int r;
+
+	for (r = 0; r < 20; r++)
+	{
+		t = esp_timer_get_time();
+		draw(frames, deferred);
+		t = esp_timer_get_time() - t;
+		if (!r || t < best) best = t;
+	}
+	return best * 1000.0 / (frames * 144.0);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct { const char *name; int sprites, window; } scenes[] =
+	{
+		{ "bg", 0, 0 },
+		{ "bg+window", 0, 1 },
+		{ "bg+window+40 sprites", 1, 1 },
+	};
+	int frames = argc > 1 ? atoi(argv[1]) : 500;
+	int i;
+
+	hw.cgb = 1;
+	fb.w = 160;
+	fb.h = 144;
+	fb.pelsize = 2;
+	fb.pitch = 320;
+	fb.enabled = 1;
+	fb.ptr = (byte *)pixels[0];
+
+	printf("%-24s %12s %12s\n", "CGB scene", "line ns", "deferred ns");
+	for (i = 0; i < (int)(sizeof scenes / sizeof *scenes); i++)
+	{
+		scene(scenes[i].sprites, scenes[i].window);
+		printf("%-24s %12.1f", scenes[i].name, run(frames, 0));
+		printf(" %12.1f\n", run(frames, 1));
+	}
+	return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * drc_sim.c
+ *
+ * Simulates the audio path of main.c against a real-time clock to
+ * check that the mixer's rate control holds the fill steady.
+ *
+ * The emulator mixes one frame of sound at a time, each taking a
+ * frame's worth of real time divided by its speed, and waits while
+ * the ring is above the high watermark. The audio task moves one
+ * chunk at a time from the ring into the DMA buffers, which drain at
+ * the output rate, and reports what they still hold through
+ * pcm.queued. Sizes are the ones main.c starts with.
+ *
+ * The emulator starts out faster than real time, so the DMA buffers
+ * and the ring fill up as on the device, then runs at the speed under
+ * test. Only what follows that is judged:
+ *
+ *  - at every speed, no underflows or overflows;
+ *  - at real speed, the average fill inside the rate control's dead
+ *    band, the nudge never at its limit, the emulator never held back
+ *    by the watermark, and where the mixer runs at the output rate,
+ *    at least MIN_DIRECT of the samples written directly to the ring.
+ *
+ *   drc_sim [seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "cpu.h"
+#include "mem.h"
+#include "pcm.h"
+#include "sound.h"
+
+#define RING (8192)
+#define FRAMES (512) /* AUDIO_DMA_FRAMES */
+#define BUFFERS (6) /* AUDIO_DMA_BUFFERS */
+#define CHUNK (FRAMES * 2)
+#define HIGH_WATERMARK (CHUNK * 2)
+#define TARGET (BUFFERS * CHUNK + CHUNK / 2)
+#define FRAME_UNITS (35112) /* 2MHz units per emulator frame */
+#define SETTLE (10) /* seconds before the fill is judged */
+#define FAST (1.1) /* emulator speed until then */
+
+/* as in sound.c */
+#define DRC_RANGE 328
+#define DRC_BAND 4
+
+#define MIN_DIRECT (90) /* percent */
+
+struct ram ram;
+struct cpu cpu;
+struct hw hw;
+struct pcm pcm;
+
+static int16_t ring[RING];
+
+struct result
+{
+	int min, max; /* samples buffered before each frame is mixed */
+	unsigned underflows, overflows;
+	double held; /* share of the time the emulator waited */
+};
+
+/* the DMA buffers, counted in buffers played since the start */
+static long long played;
+static int queued;
+static double now;
+
+/* what is left in the DMA buffers, less what the playing one has sent */
+static int dma_queued()
+{
+	int sent = (int)(now * pcm.hz - played * FRAMES) * 2;
+
+	if (sent < 0) sent = 0;
+	return queued ? queued * CHUNK - sent : 0;
+}
+
+/* plays the buffers up to the due one, then refills from the ring */
+static void dma(long long due, struct result *res, int settled)
+{
+	for (; played < due; played++)
+	{
+		if (queued) queued--;
+		else if (settled) res->underflows++;
+	}
+	while (queued < BUFFERS && pcm_fill() >= CHUNK)
+	{
+		pcm_release(CHUNK);
+		queued++;
+	}
+}
+
+static void run(int rate, int engine, double speed, int seconds, struct result *res)
+{
+	double t = 0, frame = FRAME_UNITS / 2097152.0, from;
+	int settled = 0, fill;
+	unsigned overflows = 0;
+
+	pcm.stereo = 1;
+	pcm.len = RING;
+	pcm.buf = ring;
+	pcm.volume = 256;
+	pcm.target = TARGET;
+	pcm.queued = dma_queued;
+	pcm.head = pcm.tail = 0;
+	pcm.overflows = pcm.underflows = 0;
+	sound_reset();
+	sound_rate_set(rate);
+	sound_engine_set(engine);
+	sound_write(RI_NR52, 0x80);
+	sound_write(RI_NR50, 0x77);
+	sound_write(RI_NR51, 0xff);
+	sound_write(RI_NR12, 0xf0);
+	sound_write(RI_NR14, 0x87);
+
+	played = queued = 0;
+	memset(res, 0, sizeof *res);
+	res->min = RING + BUFFERS * CHUNK;
+	while (t < seconds)
+	{
+		if (!settled && t >= SETTLE)
+		{
+			settled = 1;
+			memset(&sound_stats, 0, sizeof sound_stats);
+			overflows = pcm.overflows;
+		}
+		t += settled ? frame / speed : frame / FAST;
+		dma((long long)(t * pcm.hz) / FRAMES, res, settled);
+		now = t;
+		if (settled)
+		{
+			fill = pcm_buffered();
+			if (fill < res->min) res->min = fill;
+			if (fill > res->max) res->max = fill;
+		}
+		cpu.snd += FRAME_UNITS;
+		sound_mix();
+		/* pcm_submit() wakes the audio task */
+		dma(played, res, settled);
+		/* held back until the next buffer is played */
+		from = t;
+		while (pcm_fill() > HIGH_WATERMARK)
+		{
+			dma(played + 1, res, settled);
+			t = (double)played * FRAMES / pcm.hz;
+		}
+		if (settled) res->held += t - from;
+	}
+	res->overflows = pcm.overflows - overflows;
+	res->held /= t - SETTLE;
+}
+
+/* what is wrong with a run, or NULL */
+static const char *judge(int rate, int engine, double speed, struct result *res, int avg, int direct)
+{
+	if (res->underflows) return "underflows";
+	if (res->overflows) return "overflows";
+	if (speed != 1.0) return NULL;
+	if (avg <= TARGET - TARGET / DRC_BAND || avg >= TARGET + TARGET / DRC_BAND)
+		return "fill outside the dead band";
+	if (sound_stats.step_min <= -DRC_RANGE || sound_stats.step_max >= DRC_RANGE)
+		return "nudge at its limit";
+	if (res->held > 0.001) return "held back";
+	if (sound_mix_hz(rate, engine) == sound_rates[rate] && direct < MIN_DIRECT)
+		return "too little written directly";
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static const double speeds[] = { 0.996, 0.999, 1.0, 1.001, 1.1 };
+	int seconds = argc > 1 ? atoi(argv[1]) : 60;
+	int rate, engine, i, avg, direct, bad = 0;
+	unsigned long long written;
+	const char *why;
+	struct result res;
+
+	printf("%-6s %-12s %6s %6s %6s %6s %11s %5s %6s %5s %5s\n", "hz", "mixer", "speed",
+		"min", "max", "avg", "step", "held", "direct", "under", "over");
+	for (rate = 0; rate < SOUND_RATES; rate++)
+	for (engine = 0; engine < SOUND_ENGINES; engine++)
+	for (i = 0; i < (int)(sizeof speeds / sizeof *speeds); i++)
+	{
+		run(rate, engine, speeds[i], seconds, &res);
+		avg = sound_stats.fill_count ? sound_stats.fill / sound_stats.fill_count : 0;
+		written = sound_stats.direct + sound_stats.resampled;
+		direct = written ? sound_stats.direct * 100 / written : 0;
+		printf("%-6d %-12s %6.3f %6d %6d %6d %5d..%-4d %4.1f%% %5d%% %5u %5u",
+			sound_rates[rate], sound_engine_name(engine), speeds[i],
+			res.min, res.max, avg, sound_stats.step_min, sound_stats.step_max,
+			res.held * 100, direct, res.underflows, res.overflows);
+		why = judge(rate, engine, speeds[i], &res, avg, direct);
+		if (why)
+		{
+			printf("  %s", why);
+			bad++;
+		}
+		printf("\n");
+	}
+	printf("drc_sim: %d runs outside the limits\n", bad);
+	return bad != 0;
+}
@@ -0,0 +1,431 @@
+/*
+ * sound_log.c
+ *
+ * Plays a fixed register log through the stepped mixer and compares
+ * the output against the per-sample mixer it replaced, which clocked
+ * the length, envelope and sweep counters on every output sample.
+ *
+ * The Makefile builds this once against sound.c and once, with
+ * SOUND_REF defined, against the sound.c of SOUND_REF, the revision
+ * before the mixer moved those counters to the 512Hz frame sequencer.
+ * Both run at 32768Hz, where RATE is exactly 64 units, so the old and
+ * new phase steps are the same.
+ *
+ *   sound_log [-b] [-d] > out.raw  writes the mixer output
+ *   sound_log -c [-b] ref.raw new.raw
+ *
+ * Both builds write l, r and a flag per frame, the flag set where a
+ * counter changed a channel's volume or turned it off.
+ *
+ * Log A has no length, envelope or sweep activity and mixes at random
+ * points; the outputs must be identical. Log B adds lengths and
+ * envelopes and mixes every sample, so the new mixer's frames can be
+ * flagged as well. The old mixer fires a counter at the first sample
+ * past its threshold, the new one on the sequencer tick, which can be
+ * up to one tick (4096 units, 64 samples) either side. So in log B a
+ * frame may only differ within 64 frames of a flag in either output,
+ * and it leaves channels alone around the time their length runs out
+ * (see expiring()). Sweep is left out of both logs: a sweep step landing on a different
+ * sample changes every phase after it.
+ *
+ * With -d the new build runs deferred, as main.c does on two cores:
+ * writes go through the log and sound_synth() renders them before each
+ * drain. Its output must match the immediate mode's, and a tick after
+ * each length runs out, NR52 as the CPU reads it must agree with the
+ * mixer about which channels are on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "cpu.h"
+#include "mem.h"
+#include "pcm.h"
+#include "sound.h"
+
+#define HZ 32768
+#define RATE_UNITS ((1<<21) / HZ)
+#define SEQ_SAMPLES (4096 / RATE_UNITS)
+#define SECONDS 20
+
+struct ram ram;
+struct cpu cpu;
+struct hw hw;
+struct pcm pcm;
+
+static int logb, deferred;
+static unsigned seed = 1;
+static int vol[4], on[4];
+
+static int rnd_next(unsigned *s, int n)
+{
+	*s = *s * 1103515245 + 12345;
+	return (*s >> 16) % n;
+}
+
+/* the log, the same for both builds */
+static int rnd(int n) { return rnd_next(&seed, n); }
+
+/* notes the channel state, then returns whether it changed since */
+static int16_t changed()
+{
+	int16_t ev = 0;
+	int i;
+
+	for (i = 0; i < 4; i++)
+	{
+		if (snd.ch[i].envol != vol[i] || snd.ch[i].on != on[i]) ev = 1;
+		vol[i] = snd.ch[i].envol;
+		on[i] = snd.ch[i].on;
+	}
+	return ev;
+}
+
+#ifdef SOUND_REF
+
+/* The old mixer writes straight into pcm.buf and is advanced one
+ * sample at a time, so each sample can be tagged with whether a
+ * counter changed a channel while it was rendered. */
+
+static int16_t buf[2];
+
+static void advance(int units)
+{
+	int need;
+	int16_t ev;
+
+	while (units > 0)
+	{
+		need = RATE_UNITS - cpu.snd;
+		if (units < need)
+		{
+			cpu.snd += units;
+			return;
+		}
+		units -= need;
+		cpu.snd += need;
+		changed();
+		pcm.pos = 0;
+		sound_mix();
+		ev = changed();
+		fwrite(buf, sizeof *buf, 2, stdout);
+		fwrite(&ev, sizeof *buf, 1, stdout);
+	}
+}
+
+static void init()
+{
+	pcm.hz = HZ;
+	pcm.stereo = 1;
+	pcm.len = 2;
+	pcm.buf = buf;
+	sound_reset();
+}
+
+static void drain()
+{
+	changed();
+}
+
+#else
+
+static int16_t ring[1<<14];
+static unsigned splits = 7; /* where log A mixes, apart from the log */
+static int checks, mismatches;
+
+/* writes out the mixed frames, flagged if a counter fired while
+   they were mixed */
+static void drain()
+{
+	int n, i;
+	int16_t *p, ev;
+
+	if (deferred) sound_synth();
+	ev = changed();
+
+	while ((p = pcm_peek(&n)), n > 0)
+	{
+		for (i = 0; i < n; i += 2)
+		{
+			fwrite(p + i, sizeof *p, 2, stdout);
+			fwrite(&ev, sizeof *p, 1, stdout);
+		}
+		pcm_release(n);
+	}
+}
+
+static void advance(int units)
+{
+	static long long now;
+	int need;
+
+	/* log B: every sample, so only one frame shares a flag */
+	while (logb && units > 0)
+	{
+		need = RATE_UNITS - now % RATE_UNITS;
+		if (need > units) need = units;
+		now += need;
+		cpu.snd += need;
+		units -= need;
+		sound_mix();
+		drain();
+	}
+	/* log A: at varying points, or left to the next write */
+	cpu.snd += units;
+	if (rnd_next(&splits, 4) == 0) sound_mix();
+	drain();
+}
+
+static void init()
+{
+	pcm.hz = HZ;
+	pcm.stereo = 1;
+	pcm.len = sizeof ring / sizeof *ring;
+	pcm.buf = ring;
+	pcm.volume = 256;
+	pcm.target = 0;
+	sound_reset();
+	sound_engine_set(SOUND_STEP);
+	sound_deferred = deferred;
+}
+
+#endif
+
+/* a write changes channels too, but it is no counter event */
+static void reg(byte r, byte b)
+{
+#ifndef SOUND_REF
+	sound_mix();
+#endif
+	drain();
+	sound_write(r, b);
+#ifndef SOUND_REF
+	if (deferred) sound_synth();
+#endif
+	changed();
+}
+
+/* length enable for log B, envelope period for log B */
+static int lenbit() { return logb && rnd(2) ? 0x40 : 0; }
+static int envper() { return logb ? rnd(8) : 0; }
+
+/* When a length runs out, the two mixers may stop the channel up to a
+   tick apart, and a stopped channel's phase stands still. A trigger
+   does not reset the phase, so a channel retriggered after that would
+   play on out of phase for good. Log B leaves channels alone around
+   the time their length runs out. */
+static long long expiry[4] = { -1, -1, -1, -1 };
+static int checked[4]; /* NR52 was checked since the length ran out */
+
+static int expiring(int ch, long long t)
+{
+	return expiry[ch] >= 0 && t > expiry[ch] - 2*4096 && t < expiry[ch] + 2*4096;
+}
+
+/* A tick after a length ran out, the CPU's NR52 must have caught up
+   with the mixer; the synth side has rendered up to the same time. */
+static void status(long long t)
+{
+#ifdef SOUND_REF
+	(void)t;
+#else
+	byte nr52;
+	int ch;
+
+	if (!deferred) return;
+	for (ch = 0; ch < 4; ch++)
+	{
+		if (expiry[ch] < 0 || t < expiry[ch] + 4096 || checked[ch]) continue;
+		checked[ch] = 1;
+		checks++;
+		sound_mix();
+		sound_synth();
+		nr52 = sound_read(RI_NR52);
+		if (((nr52 >> ch) & 1) != snd.ch[ch].on && mismatches++ < 10)
+			fprintf(stderr, "sound_log: NR52 reads %02x at %lld, channel %d is %s\n",
+				nr52, t, ch + 1, snd.ch[ch].on ? "on" : "off");
+	}
+#endif
+}
+
+static void trigger(int ch, long long t, int nrx4, int len)
+{
+	static const byte nr[4] = { RI_NR14, RI_NR24, RI_NR34, RI_NR44 };
+
+	reg(nr[ch], nrx4);
+	expiry[ch] = nrx4 & 0x40 ? t + ((long long)len << 13) : -1;
+	checked[ch] = 0;
+}
+
+static void play()
+{
+	long long t;
+	int f, v;
+
+	reg(RI_NR50, 0x77);
+	reg(RI_NR51, 0xff);
+	reg(RI_NR10, 0x00);
+
+	for (t = 0; t < (long long)SECONDS << 21; )
+	{
+		int dt = 64 + rnd(rnd(8) ? 4000 : 60000);
+		advance(dt);
+		t += dt;
+		status(t);
+
+		v = rnd(8);
+		if (v < 4 && expiring(v, t)) continue;
+		switch (v)
+		{
+		case 0:
+			f = 200 + rnd(1800);
+			reg(RI_NR11, v = rnd(256));
+			reg(RI_NR12, (rnd(16) << 4) | (rnd(2) << 3) | envper());
+			reg(RI_NR13, f);
+			trigger(0, t, 0x80 | lenbit() | (f >> 8), 64 - (v & 63));
+			break;
+		case 1:
+			f = 200 + rnd(1800);
+			reg(RI_NR21, v = rnd(256));
+			reg(RI_NR22, (rnd(16) << 4) | (rnd(2) << 3) | envper());
+			reg(RI_NR23, f);
+			trigger(1, t, 0x80 | lenbit() | (f >> 8), 64 - (v & 63));
+			break;
+		case 2:
+			if (rnd(4) == 0)
+			{
+				reg(RI_NR30, 0x00);
+				for (f = 0; f < 16; f++) reg(0x30 + f, rnd(256));
+			}
+			f = 200 + rnd(1800);
+			reg(RI_NR30, 0x80);
+			reg(RI_NR31, v = rnd(256));
+			reg(RI_NR32, rnd(4) << 5);
+			reg(RI_NR33, f);
+			trigger(2, t, 0x80 | lenbit() | (f >> 8), 256 - v);
+			break;
+		case 3:
+			reg(RI_NR41, v = rnd(64));
+			reg(RI_NR42, (rnd(16) << 4) | (rnd(2) << 3) | envper());
+			reg(RI_NR43, rnd(256));
+			trigger(3, t, 0x80 | lenbit(), 64 - v);
+			break;
+		case 4:
+			reg(RI_NR50, rnd(256) & 0x77);
+			reg(RI_NR51, rnd(256));
+			break;
+		case 5:
+			/* pitch changes without a trigger, which also stop the
+			   length counting */
+			if (expiring(0, t)) break;
+			f = 200 + rnd(1800);
+			reg(RI_NR13, f);
+			reg(RI_NR14, (f >> 8));
+			expiry[0] = -1;
+			break;
+		case 6:
+			f = 200 + rnd(1800);
+			reg(RI_NR23, f);
+			break;
+		default:
+			break;
+		}
+	}
+	advance(RATE_UNITS);
+	sound_mix();
+	drain();
+}
+
+static int16_t *load(const char *name, int width, long *frames)
+{
+	FILE *fp = fopen(name, "rb");
+	int16_t *p;
+	long n;
+
+	if (!fp)
+	{
+		perror(name);
+		exit(2);
+	}
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp) / (sizeof *p * width);
+	fseek(fp, 0, SEEK_SET);
+	p = malloc(n * width * sizeof *p + 1);
+	if (fread(p, sizeof *p * width, n, fp) != (size_t)n) n = 0;
+	fclose(fp);
+	*frames = n;
+	return p;
+}
+
+/* The new mixer holds one frame back on its direct path, so its frame
+ * k+1 is the old mixer's frame k. */
+static int compare(const char *refname, const char *newname)
+{
+	long nref, nnew, n, k, j, diff = 0, bad = 0, events = 0, run = 0, maxrun = 0;
+	int16_t *ref = load(refname, 3, &nref);
+	int16_t *new = load(newname, 3, &nnew);
+	int explained;
+
+	n = nnew - 1 < nref ? nnew - 1 : nref;
+	for (k = 0; k < n; k++)
+	{
+		if (ref[3*k+2] || new[3*k+5]) events++;
+		if (ref[3*k] == new[3*k+3] && ref[3*k+1] == new[3*k+4])
+		{
+			run = 0;
+			continue;
+		}
+		diff++;
+		if (++run > maxrun) maxrun = run;
+		explained = 0;
+		for (j = k - SEQ_SAMPLES; logb && j <= k + SEQ_SAMPLES; j++)
+			if (j >= 0 && j < n && (ref[3*j+2] || new[3*j+5])) explained = 1;
+		if (!explained && bad++ < 10)
+			fprintf(stderr, "sound_log: frame %ld differs: %d %d, was %d %d\n",
+				k, new[3*k+3], new[3*k+4], ref[3*k], ref[3*k+1]);
+	}
+
+	printf("sound_log: log %c, %ld frames, %ld counter events, %ld frames differ (longest run %ld), %ld outside the tolerance\n",
+		logb ? 'B' : 'A', n, events, diff, maxrun, bad);
+	if (n < (long)SECONDS * HZ) return 1;
+	return bad != 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, cmp = 0;
+	const char *files[2] = { 0, 0 };
+	int nfiles = 0;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-b")) logb = 1;
+		else if (!strcmp(argv[i], "-d")) deferred = 1;
+		else if (!strcmp(argv[i], "-c")) cmp = 1;
+		else if (nfiles < 2) files[nfiles++] = argv[i];
+	}
+	if (cmp)
+	{
+		if (nfiles < 2)
+		{
+			fprintf(stderr, "usage: sound_log -c [-b] ref.raw new.raw\n");
+			return 2;
+		}
+		return compare(files[0], files[1]);
+	}
+
+	init();
+	play();
+#ifndef SOUND_REF
+	if (deferred)
+		fprintf(stderr, "sound_log: log %c deferred, %d NR52 reads checked, %d disagree with the mixer\n",
+			logb ? 'B' : 'A', checks, mismatches);
+	return mismatches != 0;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,9 @@
+/* Host stand-in for the ESP-IDF header of the same name. */
+#ifndef __ESP_ATTR_H__
+#define __ESP_ATTR_H__
+
+#define IRAM_ATTR
+#define DRAM_ATTR
+#define EXT_RAM_ATTR
+
+#endif
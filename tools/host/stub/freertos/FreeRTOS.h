@@ -0,0 +1,5 @@
+/* Host stand-in for the FreeRTOS header of the same name. */
+#ifndef __FREERTOS_H__
+#define __FREERTOS_H__
+
+#endif
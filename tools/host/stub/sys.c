@@ -0,0 +1,12 @@
+/* Host stand-in for the sys_* hooks main.c provides. */
+#include <time.h>
+
+void sys_sleep(int us)
+{
+	struct timespec ts;
+
+	if (us <= 0) return;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (long)(us % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
@@ -0,0 +1,289 @@
+/*
+ * test_beam.c
+ *
+ * Latency of the racing-the-beam display mode on the host. lcd.c
+ * draws each frame at the real line rate into bands of BEAM_LINES
+ * lines and hands every finished band through fb.band() to a display
+ * thread, the way beam_band() in main.c does: BEAM_BANDS buffers go
+ * round between the two through a queue each way. The display thread
+ * stands in for the scaler and the bus by taking as long as sending
+ * the band unscaled over a 40MHz SPI bus.
+ *
+ * Every band is stamped when the LCD releases it and again when the
+ * display thread is done with it. The test reports the average and
+ * worst time between the two, and fails if the average is more than
+ * two bands' worth of lines, or if more than one band in a hundred
+ * takes a whole frame, the latency the mode exists to save. The host
+ * may preempt either thread, so the worst case alone is not judged.
+ * It also checks that the bands
+ * arrive whole and in order, hold the same pixels as the frame drawn
+ * the usual way, and that switching the LCD off sends a blank frame.
+ *
+ *   test_beam [frames]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "regs.h"
+#include "hw.h"
+#include "mem.h"
+#include "lcd.h"
+#include "fb.h"
+
+#include <esp_timer.h>
+
+#define BEAM_LINES (8) /* as in main.c */
+#define BEAM_BANDS (4)
+#define LINE_US (456 * 1000000.0 / 4194304) /* one LY line */
+#define BAND_US ((int)(BEAM_LINES * 160 * 2 * 8 / 40)) /* on a 40MHz bus */
+#define FRAME_US ((int)(154 * LINE_US))
+
+struct fb fb;
+struct hw hw;
+struct ram ram;
+int frame;
+
+void sys_sleep(int us);
+
+struct band
+{
+	byte *data;
+	int y, n;
+	int64_t stamp;
+	const un16 *expect; /* the whole frame the band was cut from */
+};
+
+/* a queue of BEAM_BANDS entries, as xQueueCreate() makes them */
+struct queue
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct band slot[BEAM_BANDS];
+	int head, count;
+};
+
+static struct queue bands, freed;
+
+static un16 buffers[BEAM_BANDS][BEAM_LINES * 160];
+/* two, as the bands of a frame can still be checked while the next
+   one is drawn */
+static un16 reference[2][144 * 160];
+static un16 blank[144 * 160];
+static const un16 *expect;
+
+static int64_t latency_total, latency_max;
+static int latency_count, late, errors;
+
+static void queue_init(struct queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+static void send(struct queue *q, const struct band *b)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == BEAM_BANDS)
+		pthread_cond_wait(&q->cond, &q->lock);
+	q->slot[(q->head + q->count++) % BEAM_BANDS] = *b;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void receive(struct queue *q, struct band *b)
+{
+	pthread_mutex_lock(&q->lock);
+	while (!q->count)
+		pthread_cond_wait(&q->cond, &q->lock);
+	*b = q->slot[q->head];
+	q->head = (q->head + 1) % BEAM_BANDS;
+	q->count--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void fail(const char *what, int y)
+{
+	if (errors++ < 10) printf("test_beam: %s, line %d\n", what, y);
+}
+
+/* the LCD side, as beam_band() in main.c */
+static byte *beam_band(byte *data, int y, int n)
+{
+	struct band b = { data, y, n, esp_timer_get_time(), expect };
+
+	send(&bands, &b);
+	receive(&freed, &b);
+	return b.data;
+}
+
+static void *display(void *arg)
+{
+	struct band b;
+	int next = 0, y;
+	int64_t start, latency;
+
+	(void)arg;
+	for (;;)
+	{
+		receive(&bands, &b);
+		if (!b.data) break;
+		if (b.y != next) fail("band out of order", b.y);
+		if (b.n != (144 - b.y < BEAM_LINES ? 144 - b.y : BEAM_LINES))
+			fail("short band", b.y);
+		for (y = 0; y < b.n; y++)
+			if (memcmp(b.data + y * fb.pitch, b.expect + (b.y + y) * 160, 320))
+				fail(b.expect == blank ? "line not blanked" : "line differs", b.y + y);
+		next = (b.y + b.n) % 144;
+
+		/* scaled and sent */
+		start = esp_timer_get_time();
+		while (esp_timer_get_time() - start < BAND_US);
+
+		latency = esp_timer_get_time() - b.stamp;
+		latency_total += latency;
+		if (latency > latency_max) latency_max = latency;
+		if (latency >= FRAME_US) late++;
+		latency_count++;
+		send(&freed, &b);
+	}
+	return NULL;
+}
+
+static void scene()
+{
+	int i;
+
+	srand(1);
+	memset(&lcd, 0, sizeof lcd);
+	for (i = 0; i < 0x2000; i++)
+	{
+		lcd.vbank[0][i] = rand();
+		lcd.vbank[1][i] = rand() & 0x6f;
+	}
+	for (i = 0; i < 128; i++)
+		lcd.pal[i] = rand();
+	for (i = 0; i < 40; i++)
+	{
+		lcd.oam.obj[i].y = 16 + (i / 10) * 36;
+		lcd.oam.obj[i].x = 8 + (i % 10) * 15;
+		lcd.oam.obj[i].pat = rand();
+		lcd.oam.obj[i].flags = rand();
+	}
+	R_LCDC = 0xe7;
+	R_WX = 7 + 40;
+	R_WY = 72;
+	pal_dirty();
+}
+
+/* one frame the usual way, the pixels the bands must hold */
+static void draw_reference(un16 *p)
+{
+	int y;
+
+	fb.band = NULL;
+	fb.ptr = (byte *)p;
+	vram_dirty();
+	hw.padreads = 1;
+	frame = 2;
+	lcd_begin();
+	for (y = 0; y < 144; y++)
+	{
+		R_LY = y;
+		lcd_refreshline();
+	}
+	lcd_endframe();
+}
+
+/* the same frame at the line rate, band by band */
+static void draw_beam(byte **ptr, const un16 *p)
+{
+	int64_t start = esp_timer_get_time();
+	int y;
+
+	fb.band = beam_band;
+	fb.ptr = *ptr;
+	expect = p;
+	vram_dirty();
+	hw.padreads = 1;
+	frame = 2;
+	lcd_begin();
+	for (y = 0; y < 144; y++)
+	{
+		R_LY = y;
+		lcd_refreshline();
+		sys_sleep((int)(start + (y + 1) * LINE_US - esp_timer_get_time()));
+	}
+	lcd_endframe();
+	*ptr = fb.ptr;
+	sys_sleep((int)(start + FRAME_US - esp_timer_get_time()));
+}
+
+int main(int argc, char **argv)
+{
+	int frames = argc > 1 ? atoi(argv[1]) : 120;
+	int f, i, avg;
+	byte *ptr = (byte *)buffers[0];
+	struct band b = { 0 };
+	pthread_t thread;
+
+	hw.cgb = 1;
+	fb.w = 160;
+	fb.h = 144;
+	fb.pelsize = 2;
+	fb.pitch = 320;
+	fb.enabled = 1;
+	fb.bandlines = BEAM_LINES;
+	memset(blank, 0xff, sizeof blank);
+	queue_init(&bands);
+	queue_init(&freed);
+	for (i = 1; i < BEAM_BANDS; i++)
+	{
+		b.data = (byte *)buffers[i];
+		send(&freed, &b);
+	}
+	scene();
+	pthread_create(&thread, NULL, display, NULL);
+
+	for (f = 0; f < frames; f++)
+	{
+		R_SCX = f;
+		R_SCY = f * 3;
+		draw_reference(reference[f & 1]);
+		draw_beam(&ptr, reference[f & 1]);
+	}
+
+	/* switched off, the LCD sends one blank frame and then nothing */
+	fb.band = beam_band;
+	fb.ptr = ptr;
+	expect = blank;
+	R_LCDC &= ~0x80;
+	for (i = 0; i < 2; i++)
+	{
+		R_LY = 0;
+		lcd_refreshline();
+	}
+
+	b.data = NULL;
+	send(&bands, &b);
+	pthread_join(thread, NULL);
+
+	avg = latency_count ? (int)(latency_total / latency_count) : 0;
+	if (latency_count != (frames + 1) * 18)
+	{
+		printf("test_beam: %d bands lost\n", (frames + 1) * 18 - latency_count);
+		errors++;
+	}
+	if (avg > 2 * BEAM_LINES * LINE_US || late * 100 > latency_count)
+	{
+		printf("test_beam: latency over the limits\n");
+		errors++;
+	}
+	printf("test_beam: %d bands, latency avg %d us, max %lld us, %d a frame late (band sent in %d us), %d errors\n",
+		latency_count, avg, (long long)latency_max, late, BAND_US, errors);
+	return errors != 0;
+}
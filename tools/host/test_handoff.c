@@ -0,0 +1,100 @@
+// Stress test of the triple buffer in handoff.h: a producer and a consumer
+// thread hand three buffers back and forth as fast as they can. Each side
+// marks the buffer it holds, so a buffer written while it is being read, or
+// read while it is being written, is caught as it happens; every buffer is
+// also filled with its frame number, which catches torn frames and frames
+// published out of order.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "handoff.h"
+
+#define BUFFERS (3)
+#define WORDS   (256)
+
+static uint32_t buffers[BUFFERS][WORDS];
+static atomic_int writing[BUFFERS];
+static atomic_int reading[BUFFERS];
+static atomic_uint latest = 1;
+static atomic_bool done;
+
+static uint32_t frames;
+static uint32_t dropped;
+static uint32_t taken;
+static atomic_int errors;
+
+static void fail(const char* what, unsigned int buffer) {
+    if (atomic_fetch_add(&errors, 1) < 10) printf("test_handoff: %s, buffer %u\n", what, buffer);
+}
+
+static void* producer(void* arg) {
+    (void) arg;
+    unsigned int current = 0;
+    for (uint32_t frame = 1; frame <= frames; frame++) {
+        atomic_store(&writing[current], 1);
+        if (atomic_load(&reading[current])) fail("written while read", current);
+        for (int i = 0; i < WORDS; i++) buffers[current][i] = frame;
+        atomic_store(&writing[current], 0);
+
+        bool drop;
+        current = handoff_publish(&latest, current, &drop);
+        if (drop) dropped++;
+        // Hand the core over now and then, so a single core interleaves the two sides too
+        if ((frame & 15) == 0) sched_yield();
+    }
+    atomic_store(&done, true);
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    (void) arg;
+    unsigned int owned = 2;
+    uint32_t last = 0;
+    for (;;) {
+        bool finished = atomic_load(&done);
+        if (!handoff_take(&latest, &owned)) {
+            if (finished) break;
+            sched_yield();
+            continue;
+        }
+        atomic_store(&reading[owned], 1);
+        if (atomic_load(&writing[owned])) fail("read while written", owned);
+        uint32_t frame = buffers[owned][0];
+        for (int i = 1; i < WORDS; i++) {
+            if (buffers[owned][i] != frame) {
+                fail("torn frame", owned);
+                break;
+            }
+        }
+        if (frame <= last) fail("stale frame", owned);
+        last = frame;
+        if (atomic_load(&writing[owned])) fail("written while read", owned);
+        atomic_store(&reading[owned], 0);
+        taken++;
+    }
+    if (last != frames) fail("last frame never taken", owned);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    pthread_t threads[2];
+
+    frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 2000000;
+    pthread_create(&threads[0], NULL, consumer, NULL);
+    pthread_create(&threads[1], NULL, producer, NULL);
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[0], NULL);
+
+    printf("test_handoff: %u frames, %u taken, %u dropped, %d errors\n", frames, taken, dropped, atomic_load(&errors));
+    if (taken + dropped != frames) {
+        printf("test_handoff: frames were lost\n");
+        return 1;
+    }
+    return atomic_load(&errors) ? 1 : 0;
+}